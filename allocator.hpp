@@ -2,44 +2,170 @@
 #define allocator_hpp
 #include <iostream>
 #include <unordered_set>
-#include <set>
+#include <unordered_map>
+#include <climits>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include "stack.hpp"
 #include "object.hpp"
+#include "heap.hpp"
 #include "scope.hpp"
 using namespace std;
 
+enum GCMode { FULL_GC, GENERATIONAL_GC, INCREMENTAL_GC, CONCURRENT_GC };
+
+// How the collector runs, set from the command line (main.cpp).
+struct GCConfig {
+    GCMode mode;
+    int nursery;        // young objects allocated between minor collections
+    int budget;         // work an incremental step does, see incrementalStep(),
+                        // or the concurrent marker between letting go of the heap
+    bool report;        // keep every pause's length for reportPauses()
+};
+
+GCConfig& gcConfig() {
+    static GCConfig config = { FULL_GC, 4096, 2000, false };
+    return config;
+}
+
+/*
+    Generational mode: an object allocated since the last collection is
+    young and one that survived a collection is old. Objects don't move
+    (the engines keep Objects in C++ locals across the points a collection
+    can happen at), so an object's mark bit is what makes it old: a minor
+    collection marks from the roots without clearing the marks, which stops
+    it at old objects, frees the young ones it didn't reach and leaves the
+    survivors marked. The old objects a young one was stored into since are
+    found through remembered, filled in by writeBarrier(), which everything
+    storing into a list, struct or cell has to call first. Once enough has
+    been promoted a major collection clears the marks and does a full one.
+
+    Incremental mode spreads a collection over many short steps, one per
+    rungc() call while a cycle is under way, each doing about a budget's
+    worth of work. Marking is tri-color: white objects are unmarked, grey
+    ones are marked and on the grey stack waiting to have their children
+    marked, black ones marked and done. The write barrier keeps a black
+    object from holding a white one by marking whatever is stored into a
+    marked object grey, and anything allocated while marking starts grey.
+    The roots aren't behind the barrier, so once the grey stack runs out
+    they're marked again in one go (the remark) before sweeping starts.
+    Sweeping goes a page at a time; an object allocated into a page the
+    sweep hasn't reached yet is marked so the sweep keeps it.
+
+    Concurrent mode marks the same way on a background thread. The script
+    only stops to grey the roots, which starts the marker off, and for the
+    remark once the marker has run out of grey objects (or the heap has
+    doubled meanwhile); sweeping is then done lazily, a page at a time as
+    in incremental mode. The marker holds heapLock while it scans and lets
+    go of it every budget's worth of work. Everything that changes what it
+    scans takes the lock too while a mark is under way: storing into a
+    list, struct or cell (writeBarrier() hands back the lock, to hold until
+    the store is done), marking new objects and sorting a list in place.
+*/
 class Allocator {
     private:
+        enum Phase { IDLE, MARKING, SWEEPING };
         int NEXT_GC_LIMIT;
-        set<GCObject*> liveObjects;
+        Heap heap;
+        int live;
+        GCMode mode;
+        int nurseryLimit;
+        vector<GCObject*> young;
+        vector<GCObject*> remembered;
+        Phase phase;
+        vector<pair<GCObject*, int>> grey;   // and the index of the next list element to scan
+        vector<float> pauses;
+        recursive_mutex heapLock;
+        thread marker;
+        atomic<bool> markerDone;
+        atomic<bool> markerStop;
+        unordered_map<string, GCObject*> literals;
         bool isCollectable(Object& m);
+        template <class Visit> void eachChild(GCObject* x, Visit visit);
+        template <class Visit> void eachRoot(ActivationRecord* callStack, IndexedStack<Object>& rtStack, Visit visit);
         void markObject(Object& obj);
         void mark(ActivationRecord* callStack, IndexedStack<Object>& rtStack);
         void sweep();
+        void minorCollection(ActivationRecord* callStack, IndexedStack<Object>& rtStack);
+        void majorCollection(ActivationRecord* callStack, IndexedStack<Object>& rtStack);
+        void shade(GCObject* x);
+        void allocateBlack(GCObject* x);
+        int scanGrey(int budget);
+        void incrementalStep(ActivationRecord* callStack, IndexedStack<Object>& rtStack);
+        void concurrentStep(ActivationRecord* callStack, IndexedStack<Object>& rtStack);
+        void markInBackground();
+        void remark(ActivationRecord* callStack, IndexedStack<Object>& rtStack);
+        void sweepStep(int budget);
         void destroyList(List* list);
         void destroyStruct(Struct* obj);
         void destroyObject(GCObject* obj);
         void registerObject(GCObject* obj);
     public:
         Allocator();
+        ~Allocator();
         Object makeString(string val);
+        Object internString(const string& val);
+        void adoptLiteral(Object& m);
         Object makeList(List* list);
         Object makeFunction(Function* func);
         Object makeStruct(Struct* st);
+        Object makeCell(Object value);
+        unique_lock<recursive_mutex> holdMarker();
+        unique_lock<recursive_mutex> writeBarrier(Object container, Object value);
+        bool collectionDue();
         void rungc(ActivationRecord* callStack, IndexedStack<Object>& rtStack);
+        void holdCollection();
+        void adopt(Allocator& other);
         int liveCount();
         int nextGC();
+        void reportPauses();
 };
 
 Allocator::Allocator() {
     NEXT_GC_LIMIT = 150;
+    live = 0;
+    mode = gcConfig().mode;
+    nurseryLimit = gcConfig().nursery;
+    phase = IDLE;
+    markerDone = false;
+    markerStop = false;
+    if (mode == GENERATIONAL_GC)
+        NEXT_GC_LIMIT = 4 * nurseryLimit;
+}
+
+Allocator::~Allocator() {
+    if (marker.joinable())
+        marker.join();
 }
 
 int Allocator::nextGC() {
     return NEXT_GC_LIMIT;
 }
+// For a worker thread's allocator: it can't see the roots the parent's
+// objects hang off, so it never collects and its objects are adopt()ed by
+// the parent once the worker is done.
+void Allocator::holdCollection() {
+    NEXT_GC_LIMIT = INT_MAX;
+    nurseryLimit = INT_MAX;
+}
+
+void Allocator::adopt(Allocator& other) {
+    if (phase == MARKING) {
+        auto held = holdMarker();
+        other.heap.forEach([&](GCObject* x) { shade(x); });
+    }
+    heap.adopt(other.heap);
+    live += other.live;
+    other.live = 0;
+    young.insert(young.end(), other.young.begin(), other.young.end());
+    other.young.clear();
+}
+
 int Allocator::liveCount() {
-    return liveObjects.size();
+    return live;
 }
 
 bool Allocator::isCollectable(Object& m) {
@@ -48,6 +174,7 @@ bool Allocator::isCollectable(Object& m) {
         case AS_LIST:
         case AS_STRING:
         case AS_STRUCT:
+        case AS_CELL:
             return m.data.gcobj != nullptr;
         default:
             break;
@@ -56,36 +183,63 @@ bool Allocator::isCollectable(Object& m) {
 }
 
 void Allocator::registerObject(GCObject* object) {
-    object->marked = false;
-    liveObjects.insert(object);
+    live++;
+    if (mode == GENERATIONAL_GC)
+        young.push_back(object);
+    else if (phase == MARKING && mode == CONCURRENT_GC)
+        allocateBlack(object);
+    else if (phase == MARKING)
+        shade(object);
+    else if (phase == SWEEPING && Heap::unswept(object))
+        Heap::setMark(object);
 }
 
 Object Allocator::makeString(string val) {
     Object m;
     m.type = AS_STRING;
-    /*
-        To really make this feasable would need: a bi-directional map to quickly query string to address by value,
-        and we would probably want to have separate live lists for string/list/struct instead of one for GCObject
-    /*
-        for (auto x : liveObjects) {
-            if (x->type == GC_STRING && *x->strval == val) {
-                cout<<val<<" can be reused!"<<endl;
-                m.data.gcobj = x;
-                m.data.gcobj->marked = false;
-                return m;
-            }
-        }
-  /*  */
-    m.data.gcobj = new GCObject(new string(val));   
-    m.data.gcobj->marked = false;
+    m.data.gcobj = new (heap.allocate()) GCObject(new string(val));
     registerObject(m.data.gcobj);
     return m;
 }
 
+/*
+    String literals are interned and immortal: they aren't counted as live
+    and the collector neither scans nor frees them. Strings are mutable though,
+    so a literal about to be modified in place is first handed over to the
+    collector (adoptLiteral) and the next evaluation of that literal interns
+    a fresh copy.
+*/
+Object Allocator::internString(const string& val) {
+    Object m;
+    m.type = AS_STRING;
+    auto it = literals.find(val);
+    if (it != literals.end()) {
+        m.data.gcobj = it->second;
+        return m;
+    }
+    m.data.gcobj = new (heap.allocate()) GCObject(new string(val));
+    m.data.gcobj->immortal = true;
+    literals[val] = m.data.gcobj;
+    return m;
+}
+
+void Allocator::adoptLiteral(Object& m) {
+    if (!isCollectable(m) || !m.data.gcobj->immortal)
+        return;
+    literals.erase(*m.data.gcobj->strval);
+    auto held = holdMarker();
+    m.data.gcobj->immortal = false;
+    // not young: old objects may hold it without having been remembered,
+    // and black ones without having greyed it
+    live++;
+    if (phase == MARKING || (phase == SWEEPING && Heap::unswept(m.data.gcobj)))
+        Heap::setMark(m.data.gcobj);
+}
+
 Object Allocator::makeFunction(Function* func) {
     Object m;
     m.type = AS_FUNC;
-    m.data.gcobj = new GCObject(func);
+    m.data.gcobj = new (heap.allocate()) GCObject(func);
     registerObject(m.data.gcobj);
     return m;
 }
@@ -93,7 +247,15 @@ Object Allocator::makeFunction(Function* func) {
 Object Allocator::makeStruct(Struct* st) {
     Object m; 
     m.type = AS_STRUCT;
-    m.data.gcobj = new GCObject(st);
+    m.data.gcobj = new (heap.allocate()) GCObject(st);
+    registerObject(m.data.gcobj);
+    return m;
+}
+
+Object Allocator::makeCell(Object value) {
+    Object m;
+    m.type = AS_CELL;
+    m.data.gcobj = new (heap.allocate()) GCObject(new Object(value));
     registerObject(m.data.gcobj);
     return m;
 }
@@ -101,104 +263,328 @@ Object Allocator::makeStruct(Struct* st) {
 Object Allocator::makeList(List* list) {
     Object m;
     m.type = AS_LIST;
-    m.data.gcobj = new GCObject(list);
+    m.data.gcobj = new (heap.allocate()) GCObject(list);
     registerObject(m.data.gcobj);
     return m;
 }
 
+bool Allocator::collectionDue() {
+    switch (mode) {
+        case GENERATIONAL_GC: return young.size() > nurseryLimit;
+        case INCREMENTAL_GC:  return phase != IDLE || live > NEXT_GC_LIMIT;
+        case CONCURRENT_GC:   return phase == MARKING ? markerDone || live > 2 * NEXT_GC_LIMIT:(phase == SWEEPING || live > NEXT_GC_LIMIT);
+        default:
+            break;
+    }
+    return live > NEXT_GC_LIMIT;
+}
+
+// Keeps a concurrent marker off the heap for as long as what it returns is
+// held; doesn't lock anything when none is running.
+unique_lock<recursive_mutex> Allocator::holdMarker() {
+    if (mode == CONCURRENT_GC && phase == MARKING)
+        return unique_lock<recursive_mutex>(heapLock);
+    return unique_lock<recursive_mutex>();
+}
+
+// Has to be called before value is stored into container (a list, struct
+// or cell) while a generational, incremental or concurrent collector could
+// be running, see above, and what it returns held until the store is done.
+unique_lock<recursive_mutex> Allocator::writeBarrier(Object container, Object value) {
+    auto held = holdMarker();
+    if (mode == FULL_GC || (mode != GENERATIONAL_GC && phase != MARKING) || !isCollectable(value))
+        return held;
+    GCObject* x = container.data.gcobj;
+    if (value.data.gcobj->immortal || Heap::isMarked(value.data.gcobj) || !Heap::isMarked(x))
+        return held;
+    if (mode != GENERATIONAL_GC) {
+        shade(value.data.gcobj);
+    } else if (!x->remembered) {
+        x->remembered = true;
+        remembered.push_back(x);
+    }
+    return held;
+}
+
 void Allocator::rungc(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
     //cout<<"[GC Starting.]"<<endl;
+    auto start = chrono::steady_clock::now();
+    if (mode == INCREMENTAL_GC) {
+        incrementalStep(callStack, rtStack);
+    } else if (mode == CONCURRENT_GC) {
+        concurrentStep(callStack, rtStack);
+    } else if (mode == FULL_GC) {
+        mark(callStack, rtStack);
+        sweep();
+        NEXT_GC_LIMIT = 1.5*NEXT_GC_LIMIT;
+    } else if (live - (int)young.size() > NEXT_GC_LIMIT) {
+        majorCollection(callStack, rtStack);
+        NEXT_GC_LIMIT = max(NEXT_GC_LIMIT, 2 * live);
+    } else {
+        minorCollection(callStack, rtStack);
+    }
+    if (gcConfig().report)
+        pauses.push_back(chrono::duration<float, micro>(chrono::steady_clock::now() - start).count());
+}
+
+// Marks what's reachable from the roots and from remembered old objects
+// without passing through old ones, then frees the young objects left
+// unmarked. Costs the roots plus what's young, not the whole heap.
+void Allocator::minorCollection(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
+    mark(callStack, rtStack);
+    for (GCObject* x : remembered) {
+        x->remembered = false;
+        eachChild(x, [&](Object& m) { markObject(m); });
+    }
+    remembered.clear();
+    for (GCObject* x : young) {
+        if (!Heap::isMarked(x)) {
+            destroyObject(x);
+            heap.release(x);
+            live--;
+        }
+    }
+    young.clear();
+}
+
+void Allocator::majorCollection(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
+    for (GCObject* x : remembered)
+        x->remembered = false;
+    remembered.clear();
+    heap.clearMarks();
     mark(callStack, rtStack);
-    sweep();
-    NEXT_GC_LIMIT = 1.5*NEXT_GC_LIMIT;
+    live -= heap.sweep([](GCObject* x) { return x->immortal; },
+                       [&](GCObject* x) { destroyObject(x); }, true);
+    young.clear();
 }
 
-void Allocator::markObject(Object& object) {
-    object.data.gcobj->marked = true;
-    if (object.type == AS_LIST) {
-        for (ListNode* ln = getList(object)->head; ln != nullptr; ln = ln->next) {
-            if (isCollectable(ln->info))
-                markObject(ln->info);
+// Strings have nothing to scan, so they go straight to black.
+void Allocator::shade(GCObject* x) {
+    if (x->immortal || Heap::isMarked(x))
+        return;
+    Heap::setMark(x);
+    if (x->type != GC_STRING)
+        grey.push_back(make_pair(x, 0));
+}
+
+// A new object during a concurrent mark is scanned on the spot rather than
+// left grey, so a script allocating as fast as the marker scans can't keep
+// it from running out of grey objects.
+void Allocator::allocateBlack(GCObject* x) {
+    auto held = holdMarker();
+    Heap::setMark(x);
+    eachChild(x, [&](Object& m) { shade(m.data.gcobj); });
+}
+
+// Blackens grey objects until about budget work is done, an object and
+// each of its children counting one. A long list is done a budget's worth
+// of elements at a time, what's left of it staying grey; lists only ever
+// grow, at the front through the barrier, so nothing slips in before the
+// index it's up to (sorting calls the barrier on every element after).
+// Returns what's left of the budget.
+int Allocator::scanGrey(int budget) {
+    while (!grey.empty() && budget > 0) {
+        GCObject* x = grey.back().first;
+        int from = grey.back().second;
+        grey.pop_back();
+        budget--;
+        if (x->type == GC_LIST && x->listval != nullptr && !isLazyList(x->listval)) {
+            List* list = x->listval;
+            int to = from + min(listSize(list) - from, max(budget, 1));
+            if (to < listSize(list))
+                grey.push_back(make_pair(x, to));
+            for (int i = from; i < to; i++) {
+                if (isCollectable(listAt(list, i)))
+                    shade(listAt(list, i).data.gcobj);
+            }
+            budget -= to - from;
+        } else {
+            eachChild(x, [&](Object& m) { shade(m.data.gcobj); budget--; });
         }
-    } else if (object.type == AS_STRUCT && getStruct(object)->blessed) {
-        for (auto & m : getStruct(object)->fields) {
-            if (isCollectable(m.second))
-                markObject(m.second);
+    }
+    return budget;
+}
+
+// One step of an incremental collection, starting one if none is under
+// way: the first marks the roots grey, then steps scan grey objects until
+// none are left, remark and sweep pages, sixteen units a page plus one per
+// object freed.
+void Allocator::incrementalStep(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
+    int budget = gcConfig().budget;
+    if (phase == IDLE) {
+        phase = MARKING;
+        eachRoot(callStack, rtStack, [&](Object& m) { shade(m.data.gcobj); });
+    }
+    if (phase == MARKING) {
+        budget = scanGrey(budget);
+        if (!grey.empty())
+            return;
+        remark(callStack, rtStack);
+    }
+    sweepStep(max(budget, 1));
+}
+
+// One safepoint's worth of a concurrent collection: starting the marker off
+// from the roots, the remark once it's done (or once the heap has doubled
+// meanwhile, the remark finishing the marking), or a step of sweeping.
+void Allocator::concurrentStep(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
+    if (phase == IDLE) {
+        eachRoot(callStack, rtStack, [&](Object& m) { shade(m.data.gcobj); });
+        phase = MARKING;
+        markerDone = false;
+        markerStop = false;
+        marker = thread(&Allocator::markInBackground, this);
+    } else if (phase == MARKING) {
+        markerStop = true;
+        marker.join();
+        remark(callStack, rtStack);
+    } else {
+        sweepStep(gcConfig().budget);
+    }
+}
+
+// The marker thread: scans grey objects a budget at a time, letting go of
+// the heap in between, until there are none or it's told to stop. Anything
+// greyed after that is left for the remark.
+void Allocator::markInBackground() {
+    for (;;) {
+        {
+            lock_guard<recursive_mutex> held(heapLock);
+            if (grey.empty() || markerStop) {
+                markerDone = true;
+                return;
+            }
+            scanGrey(gcConfig().budget);
         }
+        this_thread::yield();
     }
 }
 
-void Allocator::mark(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
+// Marks the roots again, along with whatever is still grey, and starts the
+// sweep. Called with no marker running.
+void Allocator::remark(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
+    eachRoot(callStack, rtStack, [&](Object& m) { shade(m.data.gcobj); });
+    scanGrey(INT_MAX);
+    heap.beginSweep();
+    phase = SWEEPING;
+}
+
+// Sweeps about budget's worth of pages, ending the cycle once they're all
+// done.
+void Allocator::sweepStep(int budget) {
+    int freed = 0;
+    bool done = heap.sweepSome(budget, freed, [](GCObject* x) { return x->immortal; },
+                                              [&](GCObject* x) { destroyObject(x); });
+    live -= freed;
+    if (done) {
+        phase = IDLE;
+        NEXT_GC_LIMIT = max(1.5*NEXT_GC_LIMIT, 2.0*live);
+    }
+}
+
+// Calls visit on each collectable object x holds.
+template <class Visit>
+void Allocator::eachChild(GCObject* x, Visit visit) {
+    if (x->type == GC_LIST && x->listval != nullptr) {
+        List* list = x->listval;
+        if (isLazyList(list))
+            return;
+        for (int i = 0; i < listSize(list); i++) {
+            if (isCollectable(listAt(list, i)))
+                visit(listAt(list, i));
+        }
+    } else if (x->type == GC_STRUCT && x->structval != nullptr && x->structval->blessed) {
+        for (auto & m : x->structval->fields) {
+            if (isCollectable(m))
+                visit(m);
+        }
+    } else if (x->type == GC_FUNC && x->funcval != nullptr) {
+        for (auto & m : x->funcval->upvalues)
+            visit(m);
+    } else if (x->type == GC_CELL) {
+        if (isCollectable(*x->cellval))
+            visit(*x->cellval);
+    }
+}
+
+// Calls visit on each collectable object on the operand stack or in a
+// record on the call stack.
+template <class Visit>
+void Allocator::eachRoot(ActivationRecord* callStack, IndexedStack<Object>& rtStack, Visit visit) {
+    auto scope = [&](ActivationRecord* record) {
+        for (auto & m : record->bindings) {
+            if (isCollectable(m.second))
+                visit(m.second);
+        }
+        for (auto & m : record->slots) {
+            if (isCollectable(m))
+                visit(m);
+        }
+        if (isCollectable(record->function))
+            visit(record->function);
+    };
     for (int i = 0; i < rtStack.size(); i++) {
         if (isCollectable(rtStack.get(i)))
-            markObject(rtStack.get(i));
+            visit(rtStack.get(i));
     }
     for (ActivationRecord* z = callStack; z != nullptr; z = z->controlLink) {
-        for (auto & m : z->bindings) {
-            if (isCollectable(m.second) && m.second.data.gcobj->marked == false) {
-                markObject(m.second);
-            }
-            ActivationRecord* x = z->accessLink;
-            while (x != nullptr) {
-                for (auto m : x->bindings) {
-                    if (isCollectable(m.second) && m.second.data.gcobj->marked == false)
-                        markObject(m.second);
-                }
-                x = x->accessLink;
-            }
+        scope(z);
+        for (ActivationRecord* x = z->accessLink; x != nullptr; x = x->accessLink) {
+            scope(x);
         }
     }
 }
 
+void Allocator::markObject(Object& object) {
+    if (object.data.gcobj->immortal || Heap::isMarked(object.data.gcobj))
+        return;
+    Heap::setMark(object.data.gcobj);
+    eachChild(object.data.gcobj, [&](Object& m) { markObject(m); });
+}
+
+void Allocator::mark(ActivationRecord* callStack, IndexedStack<Object>& rtStack) {
+    eachRoot(callStack, rtStack, [&](Object& m) { markObject(m); });
+}
+
+// How long collection paused the script for, on stderr: the count, total,
+// median, 99th percentile and longest.
+void Allocator::reportPauses() {
+    if (pauses.empty())
+        return;
+    vector<float> sorted = pauses;
+    sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for (float p : sorted)
+        total += p;
+    cerr<<"[gc] "<<sorted.size()<<" pauses, "<<total / 1000<<"ms total, median "<<sorted[sorted.size() / 2]
+        <<"us, p99 "<<sorted[sorted.size() * 99 / 100]<<"us, max "<<sorted.back()<<"us"<<endl;
+}
+
 void Allocator::destroyList(List* list) {
     if (list == nullptr) return;
-    while (list->head != nullptr) {
-        ListNode* x = list->head;
-        list->head = list->head->next;
-        if (isCollectable(x->info))
-            destroyObject(x->info.data.gcobj);
-        delete x;
-    }
     delete list;
 }
 
 void Allocator::destroyStruct(Struct* sobj) {
     if (sobj == nullptr) return;
-    for (auto & m : sobj->fields) {
-        if (isCollectable(m.second))
-            destroyObject(m.second.data.gcobj);
-    }
     delete sobj;
 }
 
 void Allocator::destroyObject(GCObject* x) {
     switch (x->type) {
-        //case GC_FUNC:   { delete x->funcval; delete x; } break;
-        case GC_STRING: { delete x->strval;  delete x; } break;
-        case GC_LIST:   { destroyList(x->listval); delete x; } break;
-        case GC_STRUCT: { destroyStruct(x->structval); delete x; } break;
+        case GC_FUNC:   { delete x->funcval; } break;
+        case GC_STRING: { delete x->strval; } break;
+        case GC_LIST:   { destroyList(x->listval); } break;
+        case GC_STRUCT: { destroyStruct(x->structval); } break;
+        case GC_CELL:   { delete x->cellval; } break;
     }
 }
 
+// The slot itself goes back to the heap, destroyObject only frees what it
+// points to.
 void Allocator::sweep() {
-    set<GCObject*> next;
-    set<GCObject*> kill;
-    for (auto & m : liveObjects) {
-        if (m->marked == false) {
-            auto x = m;
-            kill.insert(x);
-        } else {
-            m->marked = false;
-            next.insert(m);
-        }
-    }
-    auto old = liveObjects;
-    liveObjects = next;
-    //cout<<kill.size()<<" objects have become unreachable with "<<next.size()<<" remaining in scope."<<endl;
-    for (auto & x : kill) {
-        destroyObject(x);
-    }
-    //cout<<"[GC Done.]"<<endl;
+    live -= heap.sweep([](GCObject* x) { return x->immortal; },
+                       [&](GCObject* x) { destroyObject(x); });
 }
 
 #endif
@@ -25,6 +25,15 @@ enum StmtType {
     FUNC_DEF_STMT, STRUCT_DEF_STMT, RETURN_STMT
 };
 
+// How the resolver marked a call: `return f(...)` inside a function is a
+// tail call, the callee takes over the caller's frame.
+enum TailCall {
+    NOT_TAIL_CALL, TAIL_CALL
+};
+
+// scopeSize of a block the resolver folded into the enclosing record.
+const int NO_SCOPE = -1;
+
 struct astnode {
     NodeKind nk;
     union {
@@ -32,9 +41,13 @@ struct astnode {
         StmtType stmt;
     } type;
     Token token;
+    int scopeSize;
+    int cacheIndex;     // an engine's side table entry for this node (literal, field cache), -1 until assigned
+    TailCall tail;
+    bool shared;        // a string literal that's only read, see markSharedLiterals()
     astnode* child[MAX_CHILD];
     astnode* next;
-    astnode(NodeKind kind, Token t) : nk(kind), token(t), next(nullptr) { 
+    astnode(NodeKind kind, Token t) : nk(kind), token(t), scopeSize(0), cacheIndex(-1), tail(NOT_TAIL_CALL), shared(false), next(nullptr) { 
         for (int i = 0; i < MAX_CHILD; i++)
             child[i] = nullptr;
     }
@@ -110,12 +123,36 @@ astnode* copyTree(astnode* node) {
         return nullptr;
     astnode* t = new astnode(node->nk, node->token);
     t->type = node->type;
+    t->scopeSize = node->scopeSize;
+    t->cacheIndex = node->cacheIndex;
+    t->tail = node->tail;
+    t->shared = node->shared;
     for (int i = 0; i < MAX_CHILD; i++)
         t->child[i] = copyTree(node->child[i]);
     t->next = copyTree(node->next);
     return t;
 }
 
+// Marks the string literals an engine may intern (Allocator::internString),
+// one object serving every evaluation: those whose value is read and then
+// dropped, as an operand of arithmetic or a comparison, a printed value or
+// an index. Strings can be changed in place, so anywhere else a literal may
+// end up in a binding or a container and each evaluation makes a new one.
+void markSharedLiterals(astnode* node, bool readOnly = false) {
+    for (; node != nullptr; node = node->next) {
+        bool operands;
+        if (node->nk == STMT_NODE) {
+            operands = node->type.stmt == PRINT_STMT;
+        } else {
+            if (node->type.expr == CONST_EXPR && node->token.symbol == TK_STR)
+                node->shared = readOnly;
+            operands = node->type.expr == BINOP_EXPR || node->type.expr == RELOP_EXPR || node->type.expr == UNOP_EXPR;
+        }
+        for (int i = 0; i < MAX_CHILD; i++)
+            markSharedLiterals(node->child[i], operands || (i == 1 && node->nk == EXPR_NODE && node->type.expr == SUBSCRIPT_EXPR));
+    }
+}
+
 void cleanUpTree(astnode* node) {
     if (node == nullptr)
         return;
@@ -5,16 +5,27 @@
 #include "parser.hpp"
 #include "stringbuffer.hpp"
 #include "resolve.hpp"
+#include "optimizer.hpp"
 class ASTBuilder {
     private:
         bool loud;
+        bool optimizing;
         StringBuffer sb;
         Lexer lexer;
         Parser parser;
         ScopeLevelResolver resolver;
+        ASTOptimizer optimizer;
+        astnode* finish(astnode* ast) {
+            ast = resolver.resolveScope(ast);
+            if (optimizing)
+                ast = optimizer.optimize(ast);
+            markSharedLiterals(ast);
+            return ast;
+        }
     public:
-        ASTBuilder(bool debug = false) {
+        ASTBuilder(bool debug = false, bool optimize = true) {
             loud = debug;
+            optimizing = optimize;
         }
         astnode* build(string str) {
             sb.init(str);
@@ -23,13 +34,13 @@ class ASTBuilder {
             if (loud) {
                 preorder(ast, 0);
             }
-            return resolver.resolveScope(ast);
+            return finish(ast);
         }
         astnode* buildFromFile(string filename) {
             sb.readFromFile(filename);
             TokenStream ts = lexer.lex(sb);
             astnode* ast = parser.parse(ts);
-            return resolver.resolveScope(ast);
+            return finish(ast);
         }
 };
 
@@ -0,0 +1,275 @@
+#ifndef builtins_hpp
+#define builtins_hpp
+#include <iostream>
+#include "allocator.hpp"
+#include "context.hpp"
+#include "object.hpp"
+#include "parallel.hpp"
+#include "sort.hpp"
+using namespace std;
+
+/*
+    Value level implementations of the language builtins, shared by all
+    three engines. Anything taking a VM parameter calls back into script
+    code through VM::invoke(), and keeps whatever it is building rooted on
+    the operand stack so a collection triggered by the callback can't free it.
+    map, filter and reduce hand long lists to parallel.hpp when they can,
+    sort without a comparator goes to sort.hpp.
+*/
+
+Object typeName(Context& cxt, Object m) {
+    string name = "nil";
+    switch (m.type) {
+        case AS_BOOL:   name = "boolean"; break;
+        case AS_INT:    name = "integer"; break;
+        case AS_REAL:   name = "real"; break;
+        case AS_LIST:   name = "list"; break;
+        case AS_STRING: name = "string"; break;
+        case AS_STRUCT: name = "struct"; break;
+        case AS_FUNC:   name = "function"; break;
+        case AS_NULL:
+        default:
+            break;
+    }
+    return cxt.getAlloc().makeString(name);
+}
+
+Object concatenate(Context& cxt, Object lhs, Object rhs) {
+    return cxt.getAlloc().makeString(toString(lhs) + toString(rhs));
+}
+
+Object makeRangeList(Context& cxt, Object lhs, Object rhs) {
+    return cxt.getAlloc().makeList(rangeList(lhs.data.intval, rhs.data.intval));
+}
+
+Object getSubscript(Context& cxt, Object container, Object index, const string& field, FieldCache* cache = nullptr) {
+    switch (container.type) {
+        case AS_LIST: {
+            List* list = getList(container);
+            int i = index.data.intval;
+            return i < 0 || i >= listSize(list) ? makeNil():listGet(list, i);
+        }
+        case AS_STRUCT: {
+            Object* m = getField(getStruct(container), field, cache);
+            if (m == nullptr) {
+                cout<<"Object doesnt have field '"<<field<<"'"<<endl;
+                return makeNil();
+            }
+            return *m;
+        }
+        case AS_STRING: {
+            string* str = getString(container);
+            int indx = getInteger(index);
+            if (indx < 0 || indx >= str->length()) {
+                cout<<"Index out of range: "<<indx<<endl;
+                return makeNil();
+            }
+            return cxt.getAlloc().makeString(string(1, str->at(indx)));
+        }
+        default:
+            break;
+    }
+    return makeNil();
+}
+
+Object setSubscript(Context& cxt, Object container, Object index, const string& field, Object value, FieldCache* cache = nullptr) {
+    switch (container.type) {
+        case AS_LIST: {
+            auto held = cxt.getAlloc().writeBarrier(container, value);
+            updateListAt(getList(container), index.data.intval, value);
+        } break;
+        case AS_STRUCT: {
+            Object* m = getField(getStruct(container), field, cache);
+            if (m == nullptr) {
+                cout<<"Object doesnt have field '"<<field<<"'"<<endl;
+                return makeNil();
+            }
+            auto held = cxt.getAlloc().writeBarrier(container, value);
+            *m = value;
+        } break;
+        case AS_STRING: {
+            string* str = getString(container);
+            int indx = getInteger(index);
+            if (indx < 0 || indx >= str->length()) {
+                cout<<"Index out of range: "<<indx<<endl;
+                return makeNil();
+            }
+            cxt.getAlloc().adoptLiteral(container);
+            *str = str->substr(0, indx) + toString(value) + str->substr(indx+1);
+        } break;
+        default:
+            break;
+    }
+    return value;
+}
+
+// x[lo .. hi], both ends inclusive and clamped to x. A list slice is a
+// view sharing x's storage, a string slice is a copy.
+Object getSlice(Context& cxt, Object container, Object lo, Object hi) {
+    int from = getInteger(lo), to = getInteger(hi);
+    switch (container.type) {
+        case AS_LIST:
+            return cxt.getAlloc().makeList(sliceList(getList(container), from, to));
+        case AS_STRING: {
+            string* str = getString(container);
+            from = max(from, 0);
+            to = min(to, (int)str->length() - 1);
+            return cxt.getAlloc().makeString(to < from ? "":str->substr(from, to - from + 1));
+        }
+        default:
+            break;
+    }
+    cout<<"Error: only lists and strings can be sliced."<<endl;
+    return makeNil();
+}
+
+Object getSize(Object m) {
+    switch (m.type) {
+        case AS_LIST:   return makeInt(listSize(getList(m)));
+        case AS_STRING: return makeInt(getString(m)->size());
+        default:
+            break;
+    }
+    cout<<"Error: incorrect type supplied to size()."<<endl;
+    return makeNil();
+}
+
+Object getEmpty(Object m) {
+    switch (m.type) {
+        case AS_LIST:   return makeBool(listEmpty(getList(m)));
+        case AS_STRING: return makeBool(getString(m)->empty());
+        default:
+            break;
+    }
+    return makeBool(true);
+}
+
+Object getFirst(Object m) {
+    if (m.type != AS_LIST || listEmpty(getList(m)))
+        return makeNil();
+    return listGet(getList(m), 0);
+}
+
+Object getRest(Context& cxt, Object m) {
+    if (m.type != AS_LIST || listEmpty(getList(m)))
+        return cxt.getAlloc().makeList(new List());
+    return cxt.getAlloc().makeList(restList(getList(m)));
+}
+
+Object blessStruct(Context& cxt, string name) {
+    StructType* type = cxt.getInstanceType(name);
+    if (type == nullptr) {
+        cout<<"No such type '"<<name<<"'"<<endl;
+        return makeNil();
+    }
+    Struct* nextInstance = new Struct(type);
+    nextInstance->blessed = true;
+    return cxt.getAlloc().makeStruct(nextInstance);
+}
+
+template <class VM>
+Object mapList(VM& vm, Object listObj, Object func) {
+    Context& cxt = vm.context();
+    if (listObj.type == AS_LIST && runsInParallel(vm, getList(listObj), func))
+        return parallelMap(vm, getList(listObj), func);
+    Object result = cxt.getAlloc().makeList(new List());
+    if (listObj.type != AS_LIST)
+        return result;
+    cxt.getOperandStack().push(result);
+    for (ListIterator it(getList(listObj)); !it.done();) {
+        Object arg = it.next();
+        Object m = vm.invoke(func, &arg, 1);
+        auto held = cxt.getAlloc().writeBarrier(result, m);
+        appendList(getList(result), m);
+    }
+    cxt.getOperandStack().pop();
+    return result;
+}
+
+template <class VM>
+Object filterList(VM& vm, Object listObj, Object func) {
+    Context& cxt = vm.context();
+    if (listObj.type == AS_LIST && runsInParallel(vm, getList(listObj), func))
+        return parallelFilter(vm, getList(listObj), func);
+    Object result = cxt.getAlloc().makeList(new List());
+    if (listObj.type != AS_LIST)
+        return result;
+    cxt.getOperandStack().push(result);
+    for (ListIterator it(getList(listObj)); !it.done();) {
+        Object arg = it.next();
+        if (vm.invoke(func, &arg, 1).data.boolval) {
+            auto held = cxt.getAlloc().writeBarrier(result, arg);
+            appendList(getList(result), arg);
+        }
+    }
+    cxt.getOperandStack().pop();
+    return result;
+}
+
+// reduce(list, func, true) promises func is associative, which lets a long
+// list be reduced in parallel chunks.
+template <class VM>
+Object reduceList(VM& vm, Object listObj, Object func, Object associative = Object()) {
+    if (listObj.type != AS_LIST || listEmpty(getList(listObj)))
+        return makeNil();
+    if (associative.type == AS_BOOL && associative.data.boolval && runsInParallel(vm, getList(listObj), func))
+        return parallelReduce(vm, getList(listObj), func);
+    ListIterator it(getList(listObj));
+    Object args[2];
+    args[0] = it.next();
+    while (!it.done()) {
+        args[1] = it.next();
+        args[0] = vm.invoke(func, args, 2);
+    }
+    return args[0];
+}
+
+template <class VM>
+Object comprehension(VM& vm, Object listObj, Object func, Object pred) {
+    Context& cxt = vm.context();
+    if (listObj.type != AS_LIST) {
+        cout<<"Error: list comprehensions only work on lists."<<endl;
+        return makeNil();
+    }
+    Object result = cxt.getAlloc().makeList(new List());
+    cxt.getOperandStack().push(result);
+    for (ListIterator it(getList(listObj)); !it.done();) {
+        Object arg = it.next();
+        if (pred.type == AS_FUNC && !vm.invoke(pred, &arg, 1).data.boolval)
+            continue;
+        Object m = vm.invoke(func, &arg, 1);
+        auto held = cxt.getAlloc().writeBarrier(result, m);
+        appendList(getList(result), m);
+    }
+    cxt.getOperandStack().pop();
+    return result;
+}
+
+template <class VM>
+Object sortList(VM& vm, Object listObj, Object cmp) {
+    if (listObj.type != AS_LIST) {
+        cout<<"Error: sort expects a list"<<endl;
+        return makeNil();
+    }
+    // A concurrent marker mustn't scan the list while it's rearranged, but
+    // the comparator can't be called with it kept out either: a safepoint
+    // in there may have to wait for the marker to finish.
+    Allocator& alloc = vm.context().getAlloc();
+    if (cmp.type != AS_FUNC) {
+        auto held = alloc.holdMarker();
+        sortListNatural(getList(listObj));
+    } else {
+        Object args[2];
+        sortListWith(getList(listObj), [&](Object& a, Object& b) {
+            args[0] = a; args[1] = b;
+            return vm.invoke(cmp, args, 2).data.boolval;
+        }, [&]() { return alloc.holdMarker(); });
+    }
+    // The sort moved elements about behind the write barrier's back, which
+    // an incremental collection part way through the list has to hear of.
+    for (ListIterator it(getList(listObj)); !it.done();)
+        alloc.writeBarrier(listObj, it.next());
+    return listObj;
+}
+
+#endif
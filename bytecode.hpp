@@ -0,0 +1,185 @@
+#ifndef bytecode_hpp
+#define bytecode_hpp
+#include <iostream>
+#include <vector>
+#include "globals.hpp"
+#include "object.hpp"
+using namespace std;
+
+enum Opcode {
+    OP_CONST, OP_STRING, OP_LOAD, OP_STORE, OP_CURRENT_FUNC, OP_POP, OP_DUP,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_POW, OP_NEG, OP_NOT, OP_INCR,
+    OP_LT, OP_LTE, OP_GT, OP_GTE, OP_EQU, OP_NEQ,
+    OP_JUMP, OP_JUMP_FALSE, OP_JUMP_FALSE_KEEP, OP_JUMP_TRUE_KEEP,
+    OP_PRINT, OP_DEF_FUNC, OP_LAMBDA, OP_DEF_STRUCT, OP_CALL, OP_TAIL_CALL, OP_RETURN,
+    OP_ENTER_SCOPE, OP_EXIT_SCOPE,
+    OP_MAKE_LIST, OP_RANGE, OP_INDEX, OP_STORE_INDEX, OP_SLICE,
+    OP_SIZE, OP_EMPTY, OP_APPEND, OP_PUSH, OP_FIRST, OP_REST,
+    OP_MAP, OP_FILTER, OP_REDUCE, OP_SORT, OP_COMPREHEND,
+    OP_MATCHRE, OP_BLESS, OP_DEREF, OP_TYPEOF,
+    OP_INCR_VAR, OP_ADD_VAR_K, OP_CMP_JUMP, OP_CMP_K_JUMP, OP_LOAD_INDEXED, OP_HALT
+};
+
+string opcodeStr[] = {
+    "OP_CONST", "OP_STRING", "OP_LOAD", "OP_STORE", "OP_CURRENT_FUNC", "OP_POP", "OP_DUP",
+    "OP_ADD", "OP_SUB", "OP_MUL", "OP_DIV", "OP_MOD", "OP_POW", "OP_NEG", "OP_NOT", "OP_INCR",
+    "OP_LT", "OP_LTE", "OP_GT", "OP_GTE", "OP_EQU", "OP_NEQ",
+    "OP_JUMP", "OP_JUMP_FALSE", "OP_JUMP_FALSE_KEEP", "OP_JUMP_TRUE_KEEP",
+    "OP_PRINT", "OP_DEF_FUNC", "OP_LAMBDA", "OP_DEF_STRUCT", "OP_CALL", "OP_TAIL_CALL", "OP_RETURN",
+    "OP_ENTER_SCOPE", "OP_EXIT_SCOPE",
+    "OP_MAKE_LIST", "OP_RANGE", "OP_INDEX", "OP_STORE_INDEX", "OP_SLICE",
+    "OP_SIZE", "OP_EMPTY", "OP_APPEND", "OP_PUSH", "OP_FIRST", "OP_REST",
+    "OP_MAP", "OP_FILTER", "OP_REDUCE", "OP_SORT", "OP_COMPREHEND",
+    "OP_MATCHRE", "OP_BLESS", "OP_DEREF", "OP_TYPEOF",
+    "OP_INCR_VAR", "OP_ADD_VAR_K", "OP_CMP_JUMP", "OP_CMP_K_JUMP", "OP_LOAD_INDEXED", "OP_HALT"
+};
+
+/*
+    Three address code for the register vm. Operands name registers in the
+    current frame's slot array, params and locals first (numbered by the
+    resolver) followed by temporaries. Operands documented as RK may instead
+    hold a constant, encoded as -1-index into the constant pool.
+*/
+enum RegOpcode {
+    R_MOVE, R_LOADSTR, R_GETUP, R_SETUP, R_GETGLOBAL, R_SETGLOBAL, R_CURRENT_FUNC,
+    R_ADD, R_SUB, R_MUL, R_DIV, R_MOD, R_POW, R_NEG, R_NOT, R_INCR,
+    R_LT, R_LTE, R_GT, R_GTE, R_EQU, R_NEQ,
+    R_JUMP, R_JUMP_FALSE, R_JUMP_TRUE, R_CMP_JUMP,
+    R_PRINT, R_CLOSURE, R_DEF_STRUCT, R_CALL, R_TAIL_CALL, R_RETURN,
+    R_ENTER_SCOPE, R_EXIT_SCOPE,
+    R_MAKE_LIST, R_RANGE, R_INDEX, R_STORE_INDEX, R_SLICE,
+    R_SIZE, R_EMPTY, R_APPEND, R_PUSH, R_FIRST, R_REST,
+    R_MAP, R_FILTER, R_REDUCE, R_SORT, R_COMPREHEND,
+    R_MATCHRE, R_BLESS, R_DEREF, R_TYPEOF, R_HALT
+};
+
+string regOpcodeStr[] = {
+    "R_MOVE", "R_LOADSTR", "R_GETUP", "R_SETUP", "R_GETGLOBAL", "R_SETGLOBAL", "R_CURRENT_FUNC",
+    "R_ADD", "R_SUB", "R_MUL", "R_DIV", "R_MOD", "R_POW", "R_NEG", "R_NOT", "R_INCR",
+    "R_LT", "R_LTE", "R_GT", "R_GTE", "R_EQU", "R_NEQ",
+    "R_JUMP", "R_JUMP_FALSE", "R_JUMP_TRUE", "R_CMP_JUMP",
+    "R_PRINT", "R_CLOSURE", "R_DEF_STRUCT", "R_CALL", "R_TAIL_CALL", "R_RETURN",
+    "R_ENTER_SCOPE", "R_EXIT_SCOPE",
+    "R_MAKE_LIST", "R_RANGE", "R_INDEX", "R_STORE_INDEX", "R_SLICE",
+    "R_SIZE", "R_EMPTY", "R_APPEND", "R_PUSH", "R_FIRST", "R_REST",
+    "R_MAP", "R_FILTER", "R_REDUCE", "R_SORT", "R_COMPREHEND",
+    "R_MATCHRE", "R_BLESS", "R_DEREF", "R_TYPEOF", "R_HALT"
+};
+
+/*
+    Dispatch for the vm loops. Under GCC/Clang every handler ends by jumping
+    straight to the next handler through a table of label addresses, so each
+    opcode gets its own indirect branch for the predictor to learn instead of
+    all of them sharing the one at the top of a switch. Other compilers, or
+    building with -DOWL_SWITCH_DISPATCH, get the switch. Loops using these
+    name their code array code, instruction pointer ip, current instruction
+    ins and (when threaded) their label table dispatchTable.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(OWL_SWITCH_DISPATCH)
+#define OWL_THREADED_DISPATCH
+#define vmdispatch()    vmnext();
+#define vmcase(op)      L_##op:
+#define vmdefault()
+#define vmnext()        goto *dispatchTable[(ins = &code[ip++])->op]
+#else
+#define vmdispatch()    for (;;) switch ((ins = &code[ip++])->op)
+#define vmcase(op)      case op:
+#define vmdefault()     default:
+#define vmnext()        continue
+#endif
+
+struct Instruction {
+    int op;
+    int a;
+    int b;
+    int c;
+    int d;
+    int e;
+    Instruction(int o = OP_HALT, int x = 0, int y = 0, int z = 0, int w = 0, int v = 0) : op(o), a(x), b(y), c(z), d(w), e(v) { }
+};
+
+// Everything a call needs to know about its arguments that isn't on the
+// operand stack: the callee name for error messages and, for arguments
+// which are plain identifiers, a reference to where they live for ref params
+// to bind to (nil for other arguments). It's made once here, so binding a
+// ref param doesn't allocate.
+struct CallSite {
+    string callee;
+    vector<Object> argRefs;
+};
+
+struct StructDef {
+    string typeName;
+    vector<string> fields;
+};
+
+struct CodeObject {
+    string name;
+    vector<Instruction> code;
+    vector<Object> constants;
+    vector<string> strings;
+    vector<Object> literals;    // interned strings[i], filled in by the vm on first use
+    vector<FieldCache> fieldCaches; // for field accesses naming strings[i]
+    vector<CodeObject*> functions;
+    vector<StructDef> structs;
+    vector<CallSite> callsites;
+    vector<string> params;
+    vector<bool> refParams;
+    vector<pair<int,int>> captures;    // (depth, slot) of each upvalue where the closure is made
+    bool registerCode;
+    int frameSize;
+    bool pure;                  // see purity.hpp
+    FunctionProto* proto;       // shared by the closures made from a function's code
+    CodeObject(string n = "(toplevel)", bool regs = false) : name(n), registerCode(regs), frameSize(0), pure(false), proto(nullptr) { }
+    FieldCache* fieldCache(int i) {
+        if (fieldCaches.size() < strings.size())
+            fieldCaches.resize(strings.size());
+        return &fieldCaches[i];
+    }
+};
+
+// LOAD/STORE style operands are a slot number for locals and an index
+// into globalTable() for globals.
+string variableName(int index, int depth) {
+    if (depth == GLOBAL_SCOPE_DEPTH)
+        return globalTable().nameAt(index);
+    if (depth == UPVALUE_DEPTH)
+        return "upvalue " + to_string(index);
+    return "slot " + to_string(index) + "@" + to_string(depth);
+}
+
+void disassemble(CodeObject* code, int d = 0) {
+    for (int i = 0; i < d; i++) cout<<" ";
+    cout<<"<"<<code->name<<">"<<endl;
+    for (int ip = 0; ip < code->code.size(); ip++) {
+        Instruction& ins = code->code[ip];
+        for (int i = 0; i < d; i++) cout<<" ";
+        if (code->registerCode) {
+            cout<<ip<<": "<<regOpcodeStr[ins.op]<<" "<<ins.a<<" "<<ins.b<<" "<<ins.c<<" "<<ins.d<<endl;
+            continue;
+        }
+        cout<<ip<<": "<<opcodeStr[ins.op]<<" "<<ins.a<<" "<<ins.b<<" "<<ins.c;
+        switch (ins.op) {
+            case OP_INCR_VAR:
+            case OP_ADD_VAR_K:
+            case OP_LOAD:
+            case OP_STORE: cout<<"\t("<<variableName(ins.a, ins.b)<<")"; break;
+            case OP_DEF_FUNC: cout<<"\t("<<variableName(ins.b, ins.c)<<")"; break;
+            case OP_CMP_JUMP: cout<<"\t("<<opcodeStr[ins.b]<<")"; break;
+            case OP_CMP_K_JUMP: cout<<" "<<ins.d<<" "<<ins.e<<"\t("<<variableName(ins.b, ins.c)<<" "<<opcodeStr[ins.e]<<" "<<toString(code->constants[ins.d])<<")"; break;
+            case OP_LOAD_INDEXED: cout<<" "<<ins.d<<" "<<ins.e<<"\t("<<variableName(ins.a, ins.b)<<"["<<variableName(ins.c, ins.d)<<"])"; break;
+            case OP_CONST:  cout<<"\t("<<toString(code->constants[ins.a])<<")"; break;
+            case OP_STRING:
+            case OP_INDEX:
+            case OP_STORE_INDEX:
+            case OP_BLESS:  cout<<"\t("<<code->strings[ins.a]<<")"; break;
+            default:
+                break;
+        }
+        cout<<endl;
+    }
+    for (CodeObject* func : code->functions)
+        disassemble(func, d+2);
+}
+
+#endif
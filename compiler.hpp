@@ -0,0 +1,435 @@
+#ifndef compiler_hpp
+#define compiler_hpp
+#include <iostream>
+#include <unordered_map>
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "peephole.hpp"
+#include "purity.hpp"
+using namespace std;
+
+class ByteCodeCompiler {
+    private:
+        CodeObject* code;
+        PeepholeOptimizer peephole;
+        int emit(int op, int a = 0, int b = 0, int c = 0);
+        int here();
+        void patch(int addr);
+        int constant(Object obj);
+        int stringIndex(string str);
+        int callSite(astnode* node);
+        CodeObject* compileFunction(string name, astnode* params, astnode* body, astnode* captures, int scopeSize);
+        void compileStatement(astnode* node);
+        void compileStatementList(astnode* node);
+        void compileFuncDef(astnode* node);
+        void compileStructDef(astnode* node);
+        void compileAssign(astnode* node, bool keepValue);
+        void compileExpr(astnode* node);
+        void compileConst(astnode* node);
+        void compileUnary(astnode* node);
+        void compileBinary(astnode* node);
+        void compileLogic(astnode* node);
+        void compileTernary(astnode* node);
+        void compileCall(astnode* node);
+        void compileList(astnode* node);
+        void compileComprehension(astnode* node);
+    public:
+        ByteCodeCompiler();
+        CodeObject* compile(astnode* node);
+};
+
+ByteCodeCompiler::ByteCodeCompiler() {
+    code = nullptr;
+}
+
+CodeObject* ByteCodeCompiler::compile(astnode* node) {
+    code = new CodeObject();
+    compileStatementList(node);
+    emit(OP_HALT);
+    peephole.optimize(code);
+    return code;
+}
+
+int ByteCodeCompiler::emit(int op, int a, int b, int c) {
+    code->code.push_back(Instruction(op, a, b, c));
+    return code->code.size() - 1;
+}
+
+int ByteCodeCompiler::here() {
+    return code->code.size();
+}
+
+void ByteCodeCompiler::patch(int addr) {
+    code->code[addr].a = here();
+}
+
+int ByteCodeCompiler::constant(Object obj) {
+    for (int i = 0; i < code->constants.size(); i++) {
+        Object& k = code->constants[i];
+        if (k.type != obj.type)
+            continue;
+        switch (k.type) {
+            case AS_INT:  if (k.data.intval == obj.data.intval) return i; break;
+            case AS_REAL: if (k.data.realval == obj.data.realval) return i; break;
+            case AS_BOOL: if (k.data.boolval == obj.data.boolval) return i; break;
+            case AS_NULL: return i;
+            default:
+                break;
+        }
+    }
+    code->constants.push_back(obj);
+    return code->constants.size() - 1;
+}
+
+int ByteCodeCompiler::stringIndex(string str) {
+    for (int i = 0; i < code->strings.size(); i++)
+        if (code->strings[i] == str)
+            return i;
+    code->strings.push_back(str);
+    return code->strings.size() - 1;
+}
+
+int ByteCodeCompiler::callSite(astnode* node) {
+    CallSite site;
+    site.callee = node->child[0] == nullptr ? "(null)":node->child[0]->token.strval;
+    for (astnode* it = node->child[1]; it != nullptr; it = it->next) {
+        if (isExprType(it, ID_EXPR)) {
+            site.argRefs.push_back(makeReference(it->token.strval, it->token.depth, it->token.slot));
+        } else {
+            site.argRefs.push_back(makeNil());
+        }
+    }
+    code->callsites.push_back(site);
+    return code->callsites.size() - 1;
+}
+
+CodeObject* ByteCodeCompiler::compileFunction(string name, astnode* params, astnode* body, astnode* captures, int scopeSize) {
+    CodeObject* enclosing = code;
+    code = new CodeObject(name);
+    code->frameSize = scopeSize;
+    code->pure = PurityChecker().isPure(params, body);
+    for (astnode* it = captures; it != nullptr; it = it->next)
+        code->captures.push_back(make_pair(it->token.depth, it->token.slot));
+    for (astnode* it = params; it != nullptr; it = it->next) {
+        if (isExprType(it, REF_EXPR)) {
+            code->params.push_back(it->child[0]->token.strval);
+            code->refParams.push_back(true);
+        } else {
+            code->params.push_back(it->token.strval);
+            code->refParams.push_back(false);
+        }
+    }
+    if (body != nullptr && body->nk == EXPR_NODE) {
+        compileExpr(body);
+        emit(OP_RETURN);
+    } else {
+        compileStatementList(body);
+    }
+    emit(OP_CONST, constant(makeNil()));
+    emit(OP_RETURN);
+    code->proto = new FunctionProto(name, code, code->frameSize, code->pure);
+    CodeObject* compiled = code;
+    code = enclosing;
+    return compiled;
+}
+
+void ByteCodeCompiler::compileStatementList(astnode* node) {
+    for (astnode* it = node; it != nullptr; it = it->next) {
+        if (it->nk == STMT_NODE) {
+            compileStatement(it);
+        } else {
+            compileExpr(it);
+            emit(OP_POP);
+        }
+    }
+}
+
+void ByteCodeCompiler::compileStatement(astnode* node) {
+    switch (node->type.stmt) {
+        case LET_STMT: {
+            if (isExprType(node->child[0], ID_EXPR)) {
+                emit(OP_CONST, constant(makeNil()));
+                emit(OP_STORE, node->child[0]->token.slot, node->child[0]->token.depth);
+            } else if (isExprType(node->child[0], ASSIGN_EXPR)) {
+                compileAssign(node->child[0], false);
+            } else if (node->child[0] != nullptr) {
+                compileExpr(node->child[0]);
+                emit(OP_POP);
+            }
+        } break;
+        case EXPR_STMT: {
+            if (isExprType(node->child[0], ASSIGN_EXPR)) {
+                compileAssign(node->child[0], false);
+            } else if (node->child[0] != nullptr) {
+                compileExpr(node->child[0]);
+                emit(OP_POP);
+            }
+        } break;
+        case PRINT_STMT: {
+            compileExpr(node->child[0]);
+            emit(OP_PRINT, node->token.symbol == TK_PRINTLN);
+        } break;
+        case IF_STMT: {
+            compileExpr(node->child[0]);
+            int jf = emit(OP_JUMP_FALSE);
+            compileStatementList(node->child[1]);
+            if (node->child[2] != nullptr) {
+                int jend = emit(OP_JUMP);
+                patch(jf);
+                compileStatementList(node->child[2]);
+                patch(jend);
+            } else {
+                patch(jf);
+            }
+        } break;
+        case WHILE_STMT: {
+            int top = here();
+            compileExpr(node->child[0]);
+            int jf = emit(OP_JUMP_FALSE);
+            compileStatementList(node->child[1]);
+            emit(OP_JUMP, top);
+            patch(jf);
+        } break;
+        case BLOCK_STMT: {
+            if (node->scopeSize == NO_SCOPE) {
+                compileStatementList(node->child[0]);
+                break;
+            }
+            emit(OP_ENTER_SCOPE, node->scopeSize);
+            compileStatementList(node->child[0]);
+            emit(OP_EXIT_SCOPE);
+        } break;
+        case RETURN_STMT: {
+            compileExpr(node->child[0]);
+            emit(OP_RETURN);
+        } break;
+        case FUNC_DEF_STMT: compileFuncDef(node); break;
+        case STRUCT_DEF_STMT: compileStructDef(node); break;
+        default:
+            break;
+    }
+}
+
+void ByteCodeCompiler::compileFuncDef(astnode* node) {
+    code->functions.push_back(compileFunction(node->token.strval, node->child[0], node->child[1], node->child[2], node->scopeSize));
+    emit(OP_DEF_FUNC, code->functions.size() - 1, node->token.slot, node->token.depth);
+}
+
+void ByteCodeCompiler::compileStructDef(astnode* node) {
+    StructDef def;
+    def.typeName = node->child[0]->token.strval;
+    for (astnode* it = node->child[1]; it != nullptr; it = it->next) {
+        def.fields.push_back(it->child[0]->token.strval);
+    }
+    code->structs.push_back(def);
+    emit(OP_DEF_STRUCT, code->structs.size() - 1);
+}
+
+void ByteCodeCompiler::compileAssign(astnode* node, bool keepValue) {
+    astnode* target = node->child[0];
+    if (isExprType(target, ID_EXPR)) {
+        compileExpr(node->child[1]);
+        if (keepValue) emit(OP_DUP);
+        emit(OP_STORE, target->token.slot, target->token.depth);
+    } else if (isExprType(target, SUBSCRIPT_EXPR)) {
+        compileExpr(target->child[0]);
+        compileExpr(target->child[1]);
+        compileExpr(node->child[1]);
+        emit(OP_STORE_INDEX, stringIndex(target->child[1]->token.strval));
+        if (!keepValue) emit(OP_POP);
+    } else {
+        compileExpr(node->child[1]);
+        if (!keepValue) emit(OP_POP);
+    }
+}
+
+void ByteCodeCompiler::compileExpr(astnode* node) {
+    if (node == nullptr) {
+        emit(OP_CONST, constant(makeNil()));
+        return;
+    }
+    switch (node->type.expr) {
+        case CONST_EXPR: compileConst(node); break;
+        case ID_EXPR: {
+            if (node->token.depth == CURRENT_FUNCTION_DEPTH) {
+                emit(OP_CURRENT_FUNC);
+            } else {
+                emit(OP_LOAD, node->token.slot, node->token.depth);
+            }
+        } break;
+        case UNOP_EXPR: compileUnary(node); break;
+        case BINOP_EXPR:
+        case RELOP_EXPR: compileBinary(node); break;
+        case LOGIC_EXPR: compileLogic(node); break;
+        case TERNARY_EXPR: compileTernary(node); break;
+        case ASSIGN_EXPR: compileAssign(node, true); break;
+        case FUNC_EXPR: compileCall(node); break;
+        case LAMBDA_EXPR: {
+            code->functions.push_back(compileFunction("(lambda)", node->child[0], node->child[1], node->child[2], node->scopeSize));
+            emit(OP_LAMBDA, code->functions.size() - 1);
+        } break;
+        case LIST_EXPR: compileList(node); break;
+        case SUBSCRIPT_EXPR: {
+            compileExpr(node->child[0]);
+            if (isExprType(node->child[1], RANGE_EXPR)) {
+                compileExpr(node->child[1]->child[0]);
+                compileExpr(node->child[1]->child[1]);
+                emit(OP_SLICE);
+                break;
+            }
+            compileExpr(node->child[1]);
+            emit(OP_INDEX, stringIndex(node->child[1] == nullptr ? "":node->child[1]->token.strval));
+        } break;
+        case RANGE_EXPR: {
+            compileExpr(node->child[0]);
+            compileExpr(node->child[1]);
+            emit(OP_RANGE);
+        } break;
+        case ZF_EXPR: compileComprehension(node); break;
+        case REG_EXPR: {
+            compileExpr(node->child[0]);
+            compileExpr(node->child[1]);
+            emit(OP_MATCHRE);
+        } break;
+        case BLESS_EXPR: emit(OP_BLESS, stringIndex(node->child[0]->token.strval)); break;
+        case REF_EXPR: {
+            compileExpr(node->child[0]);
+            emit(OP_DEREF);
+        } break;
+        default:
+            emit(OP_CONST, constant(makeNil()));
+            break;
+    }
+}
+
+void ByteCodeCompiler::compileConst(astnode* node) {
+    switch (node->token.symbol) {
+        case TK_TRUE:  emit(OP_CONST, constant(makeBool(true))); break;
+        case TK_FALSE: emit(OP_CONST, constant(makeBool(false))); break;
+        case TK_NUM:   emit(OP_CONST, constant(parseNumber(node->token.strval))); break;
+        case TK_STR:   emit(OP_STRING, stringIndex(node->token.strval), node->shared); break;
+        case TK_TYPEOF: {
+            compileExpr(node->child[0]);
+            emit(OP_TYPEOF);
+        } break;
+        case TK_NIL:
+        default:
+            emit(OP_CONST, constant(makeNil()));
+            break;
+    }
+}
+
+void ByteCodeCompiler::compileUnary(astnode* node) {
+    compileExpr(node->child[0]);
+    switch (node->token.symbol) {
+        case TK_NOT: emit(OP_NOT); break;
+        case TK_SUB: emit(OP_NEG); break;
+        case TK_POST_INC:
+        case TK_POST_DEC: {
+            if (isExprType(node->child[0], ID_EXPR)) {
+                emit(OP_DUP);
+                emit(OP_INCR, node->token.symbol == TK_POST_INC ? 1:-1);
+                emit(OP_STORE, node->child[0]->token.slot, node->child[0]->token.depth);
+            }
+        } break;
+        default:
+            break;
+    }
+}
+
+void ByteCodeCompiler::compileBinary(astnode* node) {
+    compileExpr(node->child[0]);
+    compileExpr(node->child[1]);
+    switch (node->token.symbol) {
+        case TK_ADD: emit(OP_ADD); break;
+        case TK_SUB: emit(OP_SUB); break;
+        case TK_MUL: emit(OP_MUL); break;
+        case TK_DIV: emit(OP_DIV); break;
+        case TK_MOD: emit(OP_MOD); break;
+        case TK_POW: emit(OP_POW); break;
+        case TK_LT:  emit(OP_LT); break;
+        case TK_LTE: emit(OP_LTE); break;
+        case TK_GT:  emit(OP_GT); break;
+        case TK_GTE: emit(OP_GTE); break;
+        case TK_EQU: emit(OP_EQU); break;
+        case TK_NEQ: emit(OP_NEQ); break;
+        default:
+            break;
+    }
+}
+
+void ByteCodeCompiler::compileLogic(astnode* node) {
+    compileExpr(node->child[0]);
+    int j = emit(node->token.symbol == TK_AND ? OP_JUMP_FALSE_KEEP:OP_JUMP_TRUE_KEEP);
+    compileExpr(node->child[1]);
+    patch(j);
+}
+
+void ByteCodeCompiler::compileTernary(astnode* node) {
+    compileExpr(node->child[0]);
+    int jf = emit(OP_JUMP_FALSE);
+    compileExpr(node->child[1]);
+    int jend = emit(OP_JUMP);
+    patch(jf);
+    compileExpr(node->child[2]);
+    patch(jend);
+}
+
+void ByteCodeCompiler::compileCall(astnode* node) {
+    compileExpr(node->child[0]);
+    int argc = 0;
+    for (astnode* it = node->child[1]; it != nullptr; it = it->next) {
+        compileExpr(it);
+        argc++;
+    }
+    if (node->tail == NOT_TAIL_CALL)
+        emit(OP_CALL, argc, callSite(node));
+    else
+        emit(OP_TAIL_CALL, argc, callSite(node));
+}
+
+void ByteCodeCompiler::compileList(astnode* node) {
+    if (node->token.symbol == TK_LB) {
+        int n = 0;
+        for (astnode* it = node->child[0]; it != nullptr; it = it->next) {
+            compileExpr(it);
+            n++;
+        }
+        emit(OP_MAKE_LIST, n);
+        return;
+    }
+    compileExpr(node->child[0]);
+    switch (node->token.symbol) {
+        case TK_SIZE:  emit(OP_SIZE); break;
+        case TK_EMPTY: emit(OP_EMPTY); break;
+        case TK_FIRST: emit(OP_FIRST); break;
+        case TK_REST:  emit(OP_REST); break;
+        case TK_APPEND: compileExpr(node->child[1]); emit(OP_APPEND); break;
+        case TK_PUSH:   compileExpr(node->child[1]); emit(OP_PUSH); break;
+        case TK_MAP:    compileExpr(node->child[1]); emit(OP_MAP); break;
+        case TK_FILTER: compileExpr(node->child[1]); emit(OP_FILTER); break;
+        case TK_REDUCE: {
+            compileExpr(node->child[1]);
+            if (node->child[2] != nullptr)
+                compileExpr(node->child[2]);
+            emit(OP_REDUCE, node->child[2] != nullptr);
+        } break;
+        case TK_SORT: {
+            if (node->child[1] != nullptr)
+                compileExpr(node->child[1]);
+            emit(OP_SORT, node->child[1] != nullptr);
+        } break;
+        default:
+            break;
+    }
+}
+
+void ByteCodeCompiler::compileComprehension(astnode* node) {
+    compileExpr(node->child[0]);
+    compileExpr(node->child[1]);
+    if (node->child[2] != nullptr)
+        compileExpr(node->child[2]);
+    emit(OP_COMPREHEND, node->child[2] != nullptr);
+}
+
+#endif
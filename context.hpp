@@ -2,20 +2,25 @@
 #define context_hpp
 #include <iostream>
 #include "allocator.hpp"
+#include "globals.hpp"
 #include "scope.hpp"
 #include "stack.hpp"
 using namespace std;
 
-const int GLOBAL_SCOPE_DEPTH = -1;
-
 class Context {
     private:
-        unordered_map<string, Struct*> objects;
+        unordered_map<string, StructType*> objects;
         ActivationRecord* globals;
         ActivationRecord* current;
         Object nilObject;
         Allocator alloc;
         IndexedStack<Object> operands;
+        vector<ActivationRecord*> freeRecords;
+        void releaseRecord(ActivationRecord* record) {
+            if (!record->bindings.empty())
+                record->bindings.clear();
+            freeRecords.push_back(record);
+        }
         ActivationRecord* enclosingAt(int distance) {
             ActivationRecord* curr = current;
             while (distance > 0 && curr != nullptr) {
@@ -33,53 +38,166 @@ class Context {
             current = globals;
             nilObject = makeNil();
         }
+        // A context for a worker thread running pure callbacks (see
+        // parallel.hpp). It reads the parent's globals and struct types but
+        // has its own stacks and allocator, and never collects.
+        Context(Context* parent) : objects(parent->objects), operands(1024) {
+            globals = parent->globals;
+            if (globals->slots.size() < globalTable().size())
+                globals->slots.resize(globalTable().size());
+            current = globals;
+            nilObject = makeNil();
+            alloc.holdCollection();
+        }
         ActivationRecord*& getCallStack() {
             return current;
         }
         IndexedStack<Object>& getOperandStack() {
             return operands;
         }
-        void addStructType(Struct* st) {
+        void addStructType(StructType* st) {
             objects[st->typeName] = st;
         }
-        Struct* getInstanceType(string name) {
-            return objects[name];
+        StructType* getInstanceType(const string& name) {
+            auto it = objects.find(name);
+            return it == objects.end() ? nullptr:it->second;
+        }
+        // Records are recycled: once a call or block is left nothing can
+        // reach its record any more (closures keep cells, not records), so
+        // it goes on a free list for the next one to take over, slots and
+        // all, instead of a call allocating a fresh one.
+        ActivationRecord* newRecord(Object func, ActivationRecord* defining, ActivationRecord* calling, int slotCount) {
+            ActivationRecord* record;
+            if (freeRecords.empty()) {
+                record = new ActivationRecord();
+            } else {
+                record = freeRecords.back();
+                freeRecords.pop_back();
+            }
+            record->function = func;
+            record->accessLink = defining;
+            record->controlLink = calling;
+            record->slots.assign(slotCount, nilObject);
+            return record;
         }
-        void openScope() {
-            ActivationRecord* sf = new ActivationRecord(current, current);
-            current = sf;
+        // The record for a call of func returning to calling.
+        ActivationRecord* callRecord(Object func, ActivationRecord* calling, int slotCount) {
+            return newRecord(func, nullptr, calling, slotCount);
         }
         void openScope(ActivationRecord* scope) {
             current = scope;
         }
+        void openScope(int slotCount = 0) {
+            current = newRecord(current->function, current, current, slotCount);
+        }
         void closeScope() {
             if (current != globals) {
+                ActivationRecord* done = current;
                 current = current->controlLink;
+                releaseRecord(done);
             }
-            if (alloc.liveCount() > alloc.nextGC()) {
+            checkGC();
+        }
+        // Leaves every record opened since saved, when a call returns from
+        // inside blocks or is replaced by a tail call.
+        void unwindTo(ActivationRecord* saved) {
+            while (current != saved && current != globals) {
+                ActivationRecord* done = current;
+                current = current->controlLink;
+                releaseRecord(done);
+            }
+            current = saved;
+        }
+        void checkGC() {
+            if (alloc.collectionDue()) {
                 alloc.rungc(current, operands);
             }
         }
-        Object& get(string name, int depth) {
+        // Globals are a dense array in the global record's slots, indexed by
+        // globalTable(). It grows as new names get numbered.
+        Object& global(int index) {
+            if (index >= globals->slots.size())
+                globals->slots.resize(globalTable().size());
+            return globals->slots[index];
+        }
+        Object& get(const string& name, int depth) {
            if (depth == GLOBAL_SCOPE_DEPTH) {
-                return globals->bindings[name];
+                return global(globalTable().indexOf(name));
            }
            return enclosingAt(depth)->bindings[name];
         }
-        void put(string name, int depth, Object info) {
+        // Once the resolver has given a name a slot it's found by depth and
+        // index alone, the name is only used for anything without one.
+        Object& get(const string& name, int depth, int slot) {
+            if (slot < 0) {
+                return get(name, depth);
+            }
             if (depth == GLOBAL_SCOPE_DEPTH) {
-                globals->bindings[name] = info;
+                return global(slot);
+            }
+            return this->slot(depth, slot);
+        }
+        void put(const string& name, int depth, int slot, Object info) {
+            if (slot >= 0 && depth != GLOBAL_SCOPE_DEPTH)
+                setSlot(depth, slot, info);
+            else
+                get(name, depth, slot) = info;
+            checkGC();
+        }
+        void put(const string& name, int depth, Object info) {
+            if (depth == GLOBAL_SCOPE_DEPTH) {
+                global(globalTable().indexOf(name)) = info;
             } else {
                 enclosingAt(depth)->bindings[name] = info;
             }
-            if (alloc.liveCount() > alloc.nextGC()) {
-                alloc.rungc(current, operands);
+            checkGC();
+        }
+        // A local, seen through its cell if a closure has captured it, one
+        // of the running closure's upvalues, or _rc.
+        Object& slot(int depth, int index) {
+            if (depth < 0)
+                return depth == UPVALUE_DEPTH ? deref(getFunction(current->function)->upvalues[index]):current->function;
+            return deref(enclosingAt(depth)->slots[index]);
+        }
+        // Stores to a local or upvalue. A captured one lives in a cell,
+        // which the write barrier has to be told about and a concurrent
+        // marker kept out of.
+        void setSlot(int depth, int index, Object value) {
+            Object& m = depth == UPVALUE_DEPTH ? getFunction(current->function)->upvalues[index]:enclosingAt(depth)->slots[index];
+            if (m.type == AS_CELL) {
+                auto held = alloc.writeBarrier(m, value);
+                *m.data.gcobj->cellval = value;
+            } else {
+                m = value;
             }
         }
+        // The cell for a closure being made here to capture the variable at
+        // (depth, index). A local is moved into a fresh cell the first time
+        // it's captured, its scope then reaches it through the cell too.
+        Object capture(int depth, int index) {
+            if (depth == UPVALUE_DEPTH)
+                return getFunction(current->function)->upvalues[index];
+            Object& m = enclosingAt(depth)->slots[index];
+            if (m.type != AS_CELL)
+                m = alloc.makeCell(m);
+            return m;
+        }
+        ActivationRecord* globalScope() {
+            return globals;
+        }
         void insert(string name, Object info) {
-            current->bindings[name] = info;
+            if (current == globals) {
+                global(globalTable().indexOf(name)) = info;
+            } else {
+                current->bindings[name] = info;
+            }
         }
+        // At the top level a name only counts once something non nil was stored in it.
         bool existsInScope(string name) {
+            if (current == globals) {
+                int index = globalTable().find(name);
+                return index >= 0 && global(index).type != AS_NULL;
+            }
             return current->bindings.find(name) != current->bindings.end();
         }
         Allocator& getAlloc() {
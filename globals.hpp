@@ -0,0 +1,49 @@
+#ifndef globals_hpp
+#define globals_hpp
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+const int GLOBAL_SCOPE_DEPTH = -1;
+// A variable of an enclosing function: its slot indexes the running
+// closure's upvalues (see resolve.hpp).
+const int UPVALUE_DEPTH = -2;
+// _rc, the function whose body is running: its activation record has it.
+const int CURRENT_FUNCTION_DEPTH = -3;
+
+// Top level names are numbered the first time the resolver (or anything
+// binding a global by name) sees them. The numbering lives for the whole
+// process so REPL lines resolved one at a time all agree on it, and the
+// engines keep globals in a plain array indexed by it.
+class GlobalTable {
+    private:
+        unordered_map<string, int> indexes;
+        vector<string> names;
+    public:
+        int indexOf(const string& name) {
+            auto it = indexes.find(name);
+            if (it != indexes.end())
+                return it->second;
+            names.push_back(name);
+            indexes[name] = names.size() - 1;
+            return names.size() - 1;
+        }
+        int find(const string& name) {
+            auto it = indexes.find(name);
+            return it == indexes.end() ? -1:it->second;
+        }
+        string& nameAt(int index) {
+            return names[index];
+        }
+        int size() {
+            return names.size();
+        }
+};
+
+GlobalTable& globalTable() {
+    static GlobalTable table;
+    return table;
+}
+
+#endif
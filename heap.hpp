@@ -0,0 +1,221 @@
+#ifndef heap_hpp
+#define heap_hpp
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include "object.hpp"
+using namespace std;
+
+/*
+    Where the collector's GCObjects live. The heap is a set of pages, each
+    one aligned block holding a header and an array of object slots, so an
+    object's page is found by masking its address. A slot's mark bit and
+    whether it's in use are bits in its page's header rather than fields
+    of the object, and free slots are chained through the object itself.
+    Sweeping walks the pages in address order instead of a tree of
+    pointers, and a page left with nothing in use goes back to the system.
+*/
+
+const int HEAP_PAGE_BYTES = 16384;
+const int HEAP_PAGE_SLOTS = (HEAP_PAGE_BYTES - 2 * 64 - 64) / sizeof(GCObject) / 64 * 64;
+const int HEAP_PAGE_WORDS = HEAP_PAGE_SLOTS / 64;
+
+struct HeapPage {
+    uint64_t marks[HEAP_PAGE_WORDS];
+    uint64_t used[HEAP_PAGE_WORDS];
+    int bump;       // slots below bump have been handed out at least once
+    bool swept;     // by the incremental sweep under way, see sweepSome()
+    GCObject slots[HEAP_PAGE_SLOTS];
+};
+
+static_assert(sizeof(HeapPage) <= HEAP_PAGE_BYTES, "a heap page has to fit its alignment");
+
+class Heap {
+    private:
+        vector<HeapPage*> pages;
+        GCObject* freeList;
+        int sweepCursor;
+        HeapPage* newPage() {
+            void* block = aligned_alloc(HEAP_PAGE_BYTES, HEAP_PAGE_BYTES);
+            if (block == nullptr)
+                throw bad_alloc();
+            HeapPage* page = (HeapPage*)block;
+            for (int i = 0; i < HEAP_PAGE_WORDS; i++) {
+                page->marks[i] = 0;
+                page->used[i] = 0;
+            }
+            page->bump = 0;
+            page->swept = true;
+            pages.push_back(page);
+            return page;
+        }
+        static HeapPage* pageOf(GCObject* x) {
+            return (HeapPage*)((uintptr_t)x & ~(uintptr_t)(HEAP_PAGE_BYTES - 1));
+        }
+        static int slotOf(HeapPage* page, GCObject* x) {
+            return x - page->slots;
+        }
+    public:
+        Heap() : freeList(nullptr), sweepCursor(0) { }
+        Heap(const Heap&) = delete;
+        ~Heap() {
+            for (HeapPage* page : pages)
+                free(page);
+        }
+        // An unconstructed slot, for placement new.
+        void* allocate() {
+            GCObject* x = freeList;
+            if (x != nullptr) {
+                freeList = x->nextfree;
+            } else {
+                HeapPage* page = pages.empty() ? nullptr:pages.back();
+                if (page == nullptr || page->bump == HEAP_PAGE_SLOTS)
+                    page = newPage();
+                x = &page->slots[page->bump++];
+            }
+            HeapPage* page = pageOf(x);
+            int i = slotOf(page, x);
+            page->used[i / 64] |= 1ULL << (i % 64);
+            return x;
+        }
+        // Whether an incremental sweep under way has yet to get to x's page.
+        static bool unswept(GCObject* x) {
+            return !pageOf(x)->swept;
+        }
+        static bool isMarked(GCObject* x) {
+            HeapPage* page = pageOf(x);
+            int i = slotOf(page, x);
+            return page->marks[i / 64] & (1ULL << (i % 64));
+        }
+        static void setMark(GCObject* x) {
+            HeapPage* page = pageOf(x);
+            int i = slotOf(page, x);
+            page->marks[i / 64] |= 1ULL << (i % 64);
+        }
+        // Hands back a single slot, for a minor collection (allocator.hpp)
+        // freeing young objects one at a time.
+        void release(GCObject* x) {
+            HeapPage* page = pageOf(x);
+            int i = slotOf(page, x);
+            page->used[i / 64] &= ~(1ULL << (i % 64));
+            x->type = GC_EMPTY;
+            x->nextfree = freeList;
+            freeList = x;
+        }
+        void clearMarks() {
+            for (HeapPage* page : pages)
+                for (int w = 0; w < HEAP_PAGE_WORDS; w++)
+                    page->marks[w] = 0;
+        }
+        // Frees every slot in use which isn't marked and isn't kept alive
+        // by keep(), handing each to destroy() first. The marks are cleared
+        // too unless keepMarks: generational collection tells old objects
+        // by them. Returns how many were freed.
+        template <class Keep, class Destroy>
+        int sweep(Keep keep, Destroy destroy, bool keepMarks = false) {
+            int freed = 0;
+            freeList = nullptr;
+            vector<HeapPage*> kept;
+            for (HeapPage* page : pages) {
+                bool empty = true;
+                for (int w = 0; w < HEAP_PAGE_WORDS; w++) {
+                    uint64_t dead = page->used[w] & ~page->marks[w];
+                    for (uint64_t bits = dead; bits != 0; bits &= bits - 1) {
+                        GCObject* x = &page->slots[w * 64 + __builtin_ctzll(bits)];
+                        if (keep(x)) {
+                            dead &= ~(bits & -bits);
+                            continue;
+                        }
+                        destroy(x);
+                        freed++;
+                    }
+                    page->used[w] &= ~dead;
+                    if (!keepMarks)
+                        page->marks[w] = 0;
+                    if (page->used[w] != 0)
+                        empty = false;
+                }
+                if (empty && page != pages.back()) {
+                    free(page);
+                    continue;
+                }
+                kept.push_back(page);
+            }
+            pages.swap(kept);
+            // rebuild the free list back to front so allocation goes
+            // through the pages in address order
+            for (int p = pages.size() - 1; p >= 0; p--) {
+                HeapPage* page = pages[p];
+                for (int i = page->bump - 1; i >= 0; i--) {
+                    if (!(page->used[i / 64] & (1ULL << (i % 64)))) {
+                        page->slots[i].type = GC_EMPTY;
+                        page->slots[i].nextfree = freeList;
+                        freeList = &page->slots[i];
+                    }
+                }
+            }
+            return freed;
+        }
+        // A sweep done a few pages at a time, for the incremental collector:
+        // beginSweep() then sweepSome() until it says it's done. Pages made
+        // or adopted meanwhile count as swept already. Freed slots go on the
+        // free list as each page is done, and empty pages are kept.
+        void beginSweep() {
+            for (HeapPage* page : pages)
+                page->swept = false;
+            sweepCursor = 0;
+        }
+        // Sweeps pages until about budget work is done, a page counting
+        // sixteen and each object freed one, adding the objects freed to
+        // freed. Returns whether the sweep is done.
+        template <class Keep, class Destroy>
+        bool sweepSome(int budget, int& freed, Keep keep, Destroy destroy) {
+            while (budget > 0 && sweepCursor < pages.size()) {
+                HeapPage* page = pages[sweepCursor++];
+                if (page->swept)
+                    continue;
+                budget -= 16;
+                for (int w = 0; w < HEAP_PAGE_WORDS; w++) {
+                    uint64_t dead = page->used[w] & ~page->marks[w];
+                    for (uint64_t bits = dead; bits != 0; bits &= bits - 1) {
+                        GCObject* x = &page->slots[w * 64 + __builtin_ctzll(bits)];
+                        if (keep(x)) {
+                            dead &= ~(bits & -bits);
+                            continue;
+                        }
+                        destroy(x);
+                        x->type = GC_EMPTY;
+                        x->nextfree = freeList;
+                        freeList = x;
+                        freed++;
+                        budget--;
+                    }
+                    page->used[w] &= ~dead;
+                    page->marks[w] = 0;
+                }
+                page->swept = true;
+            }
+            return sweepCursor >= pages.size();
+        }
+        // Calls f on every object in use.
+        template <class F>
+        void forEach(F f) {
+            for (HeapPage* page : pages)
+                for (int w = 0; w < HEAP_PAGE_WORDS; w++)
+                    for (uint64_t bits = page->used[w]; bits != 0; bits &= bits - 1)
+                        f(&page->slots[w * 64 + __builtin_ctzll(bits)]);
+        }
+        // Takes over other's pages, for a worker thread's objects. They go
+        // in front of the page allocation is bumping through, what they
+        // have free turns up on the free list after the next sweep.
+        void adopt(Heap& other) {
+            for (HeapPage* page : other.pages)
+                page->swept = true;
+            pages.insert(pages.empty() ? pages.end():pages.end() - 1, other.pages.begin(), other.pages.end());
+            other.pages.clear();
+            other.freeList = nullptr;
+        }
+};
+
+#endif
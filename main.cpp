@@ -1,24 +1,29 @@
 #include <iostream>
 #include "astbuilder.hpp"
 #include "twvm.hpp"
+#include "stackvm.hpp"
+#include "regvm.hpp"
 using namespace std;
 
-void runScript(string filename) {
-    ASTBuilder astbuilder;
-    TWVM vm(false);
+template <class VM>
+void runScript(string filename, bool optimize) {
+    ASTBuilder astbuilder(false, optimize);
+    VM vm(false);
     vm.exec(astbuilder.buildFromFile(filename));
     if (vm.context().existsInScope("main")) {
         vm.exec(astbuilder.build("main();"));
     }
+    if (gcConfig().report)
+        vm.context().getAlloc().reportPauses();
 }
 
-
-void repl() {
+template <class VM>
+void repl(bool optimize) {
     cout<<"[OwlscriptSV 0.6b]"<<endl;
     bool running = true;
     string input;
-    ASTBuilder astbuilder;
-    TWVM vm(true);
+    ASTBuilder astbuilder(false, optimize);
+    VM vm(true);
     int i = 1;
     while (running) {
         cout<<"OwlScriptSV("<<i++<<")> ";
@@ -29,17 +34,67 @@ void repl() {
             astnode* ast = astbuilder.build(input);
             preorder(ast, 1);
             vm.exec(ast);
-            cleanUpTree(ast); 
+            cleanUpTree(ast);
         }
     }
     cout<<"[hoot!]"<<endl;
 }
 
+void usage(string prog) {
+    cout<<"usage: "<<prog<<" [-t|-s|-r] [-u] [-g|-i n|-c n] [-P] [-p n] [-j n] [script]"<<endl;
+    cout<<"  -t   tree walking interpreter (default)"<<endl;
+    cout<<"  -s   bytecode compiler + stack vm"<<endl;
+    cout<<"  -r   register compiler + register vm"<<endl;
+    cout<<"  -u   skip constant folding/propagation"<<endl;
+    cout<<"  -g   generational garbage collection"<<endl;
+    cout<<"  -i n incremental garbage collection, doing about n units of work per step"<<endl;
+    cout<<"  -c n concurrent garbage collection, marking on a background thread n units at a time"<<endl;
+    cout<<"  -P   print garbage collection pause times when the script ends"<<endl;
+    cout<<"  -p n split map/filter/reduce over lists of n or more elements across threads, 0 = never (default "<<parallelConfig().threshold<<")"<<endl;
+    cout<<"  -j n number of threads to split them over (default "<<parallelConfig().threads<<")"<<endl;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        repl();
+    char engine = 't';
+    bool optimize = true;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        string flag = argv[argi++];
+        if (flag == "-t" || flag == "-s" || flag == "-r") {
+            engine = flag[1];
+        } else if (flag == "-u") {
+            optimize = false;
+        } else if (flag == "-g") {
+            gcConfig().mode = GENERATIONAL_GC;
+        } else if (flag == "-i" && argi < argc) {
+            gcConfig().mode = INCREMENTAL_GC;
+            gcConfig().budget = max(atoi(argv[argi++]), 1);
+        } else if (flag == "-c" && argi < argc) {
+            gcConfig().mode = CONCURRENT_GC;
+            gcConfig().budget = max(atoi(argv[argi++]), 1);
+        } else if (flag == "-P") {
+            gcConfig().report = true;
+        } else if ((flag == "-p" || flag == "-j") && argi < argc) {
+            int n = atoi(argv[argi++]);
+            if (flag == "-p") parallelConfig().threshold = n;
+            else parallelConfig().threads = max(n, 1);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argi >= argc) {
+        switch (engine) {
+            case 's': repl<StackVM>(optimize); break;
+            case 'r': repl<RegisterVM>(optimize); break;
+            default:  repl<TWVM>(optimize); break;
+        }
     } else {
-        runScript(argv[1]);
+        switch (engine) {
+            case 's': runScript<StackVM>(argv[argi], optimize); break;
+            case 'r': runScript<RegisterVM>(argv[argi], optimize); break;
+            default:  runScript<TWVM>(argv[argi], optimize); break;
+        }
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,14 +1,17 @@
 #ifndef object_hpp
 #define object_hpp
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <unordered_map>
+#include <vector>
 #include "ast.hpp"
 using namespace std;
 
 
 enum StoreAs {
-    AS_INT, AS_REAL, AS_BOOL, AS_CHAR, AS_STRING, AS_STRUCT, AS_FUNC, AS_CLOSURE, AS_LIST, AS_MAP, AS_REF, AS_NULL
+    AS_INT, AS_REAL, AS_BOOL, AS_CHAR, AS_STRING, AS_STRUCT, AS_FUNC, AS_CLOSURE, AS_LIST, AS_MAP, AS_REF, AS_CELL, AS_NULL
 };
 
 struct List;
@@ -18,6 +21,7 @@ struct Struct;
 struct WeakRef;
 struct ActivationRecord;
 struct GCObject;
+struct CodeObject;
 
 struct Object {
     StoreAs type;
@@ -35,97 +39,148 @@ struct Object {
     Object(int val) { type = AS_INT; data.intval = val; }
     Object(WeakRef* obj) { type = AS_REF; data.reference = obj; }
     Object() { type = AS_NULL; data.intval = 0; }
-    Object(const Object& obj) {
-        type = obj.type;
-        switch (type) {
-            case AS_LIST: data.gcobj = obj.data.gcobj; break;
-            case AS_STRING: data.gcobj = obj.data.gcobj; break;
-            case AS_FUNC: data.gcobj = obj.data.gcobj; break;
-            case AS_CLOSURE: data.gcobj = obj.data.gcobj; break;
-            case AS_STRUCT: data.gcobj = obj.data.gcobj; break;
-            case AS_CHAR: data.charval = obj.data.charval; break;
-            case AS_BOOL: data.boolval = obj.data.boolval; break;
-            case AS_INT: data.intval = obj.data.intval; break;
-            case AS_REAL: data.realval = obj.data.realval; break;
-            default:
-                break;
-        }
-    }
 };
 
-struct Function {
+// What every closure made from one def or lambda shares, never freed.
+// The tree walker makes one the first time the definition runs, with its
+// own copy of the params and body since the repl frees each line's AST;
+// the compilers make one per CodeObject.
+struct FunctionProto {
     string name;
     astnode* body;
     astnode* params;
-    ActivationRecord* closure;
-    Function(astnode* par, astnode* code) : params(par), body(code), closure(nullptr) { }
-    Function() {
-        name = "nil";
-        closure = nullptr;
-    }
+    CodeObject* code;
+    int frameSize;
+    bool pure;      // may run on a worker thread, see purity.hpp
+    FunctionProto(string n, astnode* par, astnode* body, int slots, bool isPure) : name(n), body(body), params(par), code(nullptr), frameSize(slots), pure(isPure) { }
+    FunctionProto(string n, CodeObject* compiled, int slots, bool isPure) : name(n), body(nullptr), params(nullptr), code(compiled), frameSize(slots), pure(isPure) { }
 };
 
-struct ListNode {
-    Object info;
-    ListNode* next;
-    ListNode(Object obj = Object(), ListNode* n = nullptr) : info(obj), next(n) { }
+// A closure is flat: upvalues holds a cell for each variable of an
+// enclosing scope the body uses, in the order the resolver numbered them.
+struct Function {
+    FunctionProto* proto;
+    vector<Object> upvalues;
+    Function(FunctionProto* p) : proto(p) { }
 };
 
+// Element storage shared by every list that is a view onto part of it.
+// Worker threads running a parallel map may take views concurrently.
+struct ListBuffer {
+    vector<Object> items;
+    atomic<int> views;
+    ListBuffer() : views(1) { }
+};
 
+// A list is the window items[start, start+count) of a buffer. rest() and
+// slices are new windows onto the parent's buffer, so they're O(1) and
+// copy nothing; a list whose buffer has other views copies its window
+// into a buffer of its own before it is written to. Slots in front of
+// start are spare room, so push is amortized O(1) like append, and
+// indexing is O(1).
+//
+// A range a .. b starts out lazy: no buffer, element i is first + i*step.
+// Reading it through listGet()/ListIterator never allocates, and it only
+// gets a buffer (materializeList) once it's written to.
 struct List {
-    ListNode* head;
-    ListNode* tail;
+    ListBuffer* buffer;
+    int start;
     int count;
-    List() : head(nullptr), tail(nullptr) {
-        count = 0;
+    int first;
+    int step;
+    List() : buffer(new ListBuffer()), start(0), count(0), first(0), step(0) { }
+    List(int from, int by, int n) : buffer(nullptr), start(0), count(n), first(from), step(by) { }
+    List(List* parent, int from, int n) : buffer(parent->buffer), start(parent->start + from), count(n),
+                                          first(parent->first + from * parent->step), step(parent->step) {
+        if (buffer != nullptr)
+            buffer->views++;
+    }
+    ~List() {
+        if (buffer != nullptr && --buffer->views == 0)
+            delete buffer;
     }
 };
 
-struct Struct {
+// Built once when a struct is defined: the field order every instance of
+// the type is laid out in, and where each field name sits in it.
+struct StructType {
     string typeName;
+    vector<string> fieldNames;
+    unordered_map<string, int> offsets;
+    StructType(string tn) : typeName(tn) { }
+    void addField(const string& name) {
+        if (offsets.find(name) != offsets.end())
+            return;
+        offsets[name] = fieldNames.size();
+        fieldNames.push_back(name);
+    }
+    int offsetOf(const string& name) {
+        auto it = offsets.find(name);
+        return it == offsets.end() ? -1:it->second;
+    }
+};
+
+struct Struct {
+    StructType* type;
     bool blessed;
-    unordered_map<string, Object> fields;
-    Struct(string tn) : typeName(tn), blessed(false) { }
-    Struct() : typeName("nil"), blessed(false) { }
+    vector<Object> fields;
+    Struct(StructType* st) : type(st), blessed(false), fields(st->fieldNames.size()) { }
+};
+
+// Remembers the struct type last seen at one field access site and the
+// field's offset in it, so while the site keeps seeing the same type the
+// name never has to be looked up.
+struct FieldCache {
+    StructType* type;
+    int offset;
+    FieldCache() : type(nullptr), offset(-1) { }
 };
 
 struct WeakRef {
     string identifier;
     int scopelevel;
-    WeakRef(string id, int sl) : identifier(id), scopelevel(sl) { }
+    int slot;
+    WeakRef(string id, int sl, int sn = -1) : identifier(id), scopelevel(sl), slot(sn) { }
 };
 
 
 enum GC_TYPE {
-    GC_LIST, GC_STRING, GC_FUNC, GC_STRUCT, GC_EMPTY
+    GC_LIST, GC_STRING, GC_FUNC, GC_STRUCT, GC_CELL, GC_EMPTY
 };
 
 struct GCObject {
     GC_TYPE type;
-    bool marked;
+    bool immortal;
+    bool remembered;    // old and written a young object since the last collection
     union {
         string* strval;
         Function* funcval;
         List* listval;
         Closure* closureval;
         Struct* structval;
+        Object* cellval;    // a captured variable, shared by its scope and the closures using it
+        GCObject* nextfree; // a free heap slot, see heap.hpp
     };
-    GCObject(string* s) : strval(s), marked(false), type(GC_STRING) { }
-    GCObject(string s) : strval(new string(s)), marked(false), type(GC_STRING) { }
-    GCObject(List* l) : listval(l), marked(false), type(GC_LIST) { }
-    GCObject(Function* f) : funcval(f), marked(false), type(GC_FUNC) { }
-    GCObject(Closure* c) : closureval(c), marked(false), type(GC_FUNC) { }
-    GCObject(Struct* s) : structval(s), marked(false), type(GC_STRUCT) { }
+    GCObject(string* s) : strval(s), type(GC_STRING), immortal(false), remembered(false) { }
+    GCObject(string s) : strval(new string(s)), type(GC_STRING), immortal(false), remembered(false) { }
+    GCObject(List* l) : listval(l), type(GC_LIST), immortal(false), remembered(false) { }
+    GCObject(Function* f) : funcval(f), type(GC_FUNC), immortal(false), remembered(false) { }
+    GCObject(Closure* c) : closureval(c), type(GC_FUNC), immortal(false), remembered(false) { }
+    GCObject(Struct* s) : structval(s), type(GC_STRUCT), immortal(false), remembered(false) { }
+    GCObject(Object* c) : cellval(c), type(GC_CELL), immortal(false), remembered(false) { }
     GCObject(const GCObject& ob) {
+        immortal = false;
+        remembered = false;
         switch (ob.type) {
             case GC_STRING: strval = ob.strval; break;
             case GC_LIST: listval = ob.listval; break;
             case GC_FUNC: funcval = ob.funcval; break;
             case GC_STRUCT: structval = ob.structval; break;
+            case GC_CELL: cellval = ob.cellval; break;
             default: break;
         }
     }
-    GCObject() : marked(false), type(GC_EMPTY) { }
+    GCObject() : type(GC_EMPTY), immortal(false), remembered(false) { }
 };
 
 bool getBoolean(Object m) {
@@ -153,40 +208,50 @@ Function* getFunction(Object m) {
     return m.data.gcobj ? m.data.gcobj->funcval:nullptr;
 }
 
+// A variable's storage: the value itself, or the cell it was moved into
+// once a closure captured it.
+Object& deref(Object& m) {
+    return m.type == AS_CELL ? *m.data.gcobj->cellval:m;
+}
+
 string dummystring;
 string* getString(Object m) {
     return m.data.gcobj->strval == nullptr ? &dummystring:m.data.gcobj->strval;
 }
 
-Struct dummystruct;
+StructType dummytype("nil");
+Struct dummystruct(&dummytype);
 Struct* getStruct(Object m) {
     return m.data.gcobj->structval == nullptr ? &dummystruct:m.data.gcobj->structval;
 }
 
+// nullptr when the struct has no such field.
+Object* getField(Struct* st, const string& name, FieldCache* cache = nullptr) {
+    int offset;
+    if (cache != nullptr && cache->type == st->type) {
+        offset = cache->offset;
+    } else {
+        offset = st->type->offsetOf(name);
+        if (cache != nullptr) {
+            cache->type = st->type;
+            cache->offset = offset;
+        }
+    }
+    return offset < 0 ? nullptr:&st->fields[offset];
+}
+
 WeakRef* getReference(Object m) {
     return m.data.reference;
 }
 
 void printGCObject(GCObject* x) {
     switch (x->type) {
-        case GC_FUNC:   cout<<x->funcval->name<<endl; break;
+        case GC_FUNC:   cout<<x->funcval->proto->name<<endl; break;
         case GC_LIST:   cout<<"(list)"<<endl; break;
         case GC_STRING: cout<<*x->strval<<endl; break;
     }
 }
 
-List* appendList(List* list, Object obj) {
-    ListNode* t = new ListNode(obj, nullptr);
-    if (list->head == nullptr) {
-        list->head = t;
-    } else {
-        list->tail->next = t;
-    }
-    list->tail = t;
-    list->count += 1;
-    return list;
-}
-
 bool listEmpty(List* list) {
     return list->count == 0;
 }
@@ -195,35 +260,145 @@ int listSize(List* list) {
     return list == nullptr ? -1:list->count;
 }
 
+Object makeInt(int val);
+
+bool isLazyList(List* list) {
+    return list->buffer == nullptr;
+}
+
+// Gives a lazy range its elements. The buffer is filled before the list
+// points at it, the concurrent marker may walk the list at any time and
+// must see either no buffer or a complete one.
+void materializeList(List* list) {
+    if (!isLazyList(list))
+        return;
+    ListBuffer* buffer = new ListBuffer();
+    buffer->items.reserve(list->count);
+    for (int i = 0; i < list->count; i++)
+        buffer->items.push_back(makeInt(list->first + i * list->step));
+    list->start = 0;
+    atomic_thread_fence(memory_order_release);
+    list->buffer = buffer;
+}
+
+// Unchecked, index has to be in [0, listSize(list)). Materializes a lazy
+// range; only for reading, writes go through ownList() first.
+Object& listAt(List* list, int index) {
+    materializeList(list);
+    return list->buffer->items[list->start + index];
+}
+
+// Unchecked read by value, which doesn't materialize.
+Object listGet(List* list, int index) {
+    if (isLazyList(list))
+        return makeInt(list->first + index * list->step);
+    return list->buffer->items[list->start + index];
+}
+
+// What the builtins walk lists with. It rereads the list on every step, so
+// a callback appending to the list being walked is safe.
+struct ListIterator {
+    List* list;
+    int pos;
+    ListIterator(List* l) : list(l), pos(0) { }
+    bool done() { return pos >= listSize(list); }
+    Object next() { return listGet(list, pos++); }
+};
+
+// The lazy range lo .. hi, counting down when hi < lo.
+List* rangeList(int lo, int hi) {
+    return lo <= hi ? new List(lo, 1, hi - lo + 1):new List(lo, -1, lo - hi + 1);
+}
+
+// Makes list the only view of its buffer, copying its window out if the
+// buffer is shared, and drops whatever sits past the window.
+void ownList(List* list) {
+    materializeList(list);
+    vector<Object>& items = list->buffer->items;
+    if (list->buffer->views > 1) {
+        ListBuffer* own = new ListBuffer();
+        own->items.assign(items.begin() + list->start, items.begin() + list->start + list->count);
+        list->buffer->views--;
+        list->buffer = own;
+        list->start = 0;
+    } else if (items.size() > list->start + list->count) {
+        items.resize(list->start + list->count);
+    }
+}
+
+List* appendList(List* list, Object obj) {
+    ownList(list);
+    list->buffer->items.push_back(obj);
+    list->count++;
+    return list;
+}
+
 List* pushList(List* list, Object obj) {
-    ListNode* t = new ListNode(obj, list->head);
-    if (listEmpty(list)) {
-        list->tail = t;
+    ownList(list);
+    vector<Object>& items = list->buffer->items;
+    if (list->start == 0) {
+        int room = list->count + 1;
+        items.insert(items.begin(), room, Object());
+        list->start = room;
     }
-    list->head = t;
-    list->count += 1;
+    items[--list->start] = obj;
+    list->count++;
     return list;
 }
 
 List* updateListAt(List* list, int index, Object obj) {
-    int i = 0;
-    ListNode* it = list->head; 
-    while (it != nullptr && i < index) {
-        it = it->next;
-        i++;
-    }
-    it->info = obj;
+    if (index < 0 || index >= listSize(list))
+        return list;
+    ownList(list);
+    listAt(list, index) = obj;
     return list;
 }
 
-ListNode* getListItemAt(List* list, int index) {
-    int i = 0;
-    ListNode* it = list->head; 
-    while (it != nullptr && i < index) {
-        it = it->next;
-        i++;
-    }
-    return it;
+// The elements [from, to] of list, clamped to its bounds, sharing its storage.
+List* sliceList(List* list, int from, int to) {
+    from = max(from, 0);
+    to = min(to, listSize(list) - 1);
+    if (to < from)
+        return new List();
+    return new List(list, from, to - from + 1);
+}
+
+List* restList(List* list) {
+    return sliceList(list, 1, listSize(list) - 1);
+}
+
+// Stable, on a tie the element from the left run goes first.
+template <class T, class Before>
+void mergeSortObjects(vector<T>& v, vector<T>& tmp, int lo, int hi, Before& before) {
+    if (hi - lo < 2)
+        return;
+    int mid = lo + (hi - lo + 1) / 2;
+    mergeSortObjects(v, tmp, lo, mid, before);
+    mergeSortObjects(v, tmp, mid, hi, before);
+    int i = lo, j = mid, k = lo;
+    while (i < mid && j < hi)
+        tmp[k++] = before(v[j], v[i]) ? v[j++]:v[i++];
+    while (i < mid) tmp[k++] = v[i++];
+    while (j < hi) tmp[k++] = v[j++];
+    for (k = lo; k < hi; k++)
+        v[k] = tmp[k];
+}
+
+// before(a, b) says whether a goes ahead of b, it may call back into script
+// code. The sort runs on a copy so the list keeps every element (and keeps
+// them rooted) until the result is written back, which happens while what
+// hold() returns is held.
+template <class Before, class Hold>
+void sortListWith(List* list, Before before, Hold hold) {
+    vector<Object> v(list->count);
+    for (int i = 0; i < list->count; i++)
+        v[i] = listGet(list, i);
+    vector<Object> tmp(v.size());
+    mergeSortObjects(v, tmp, 0, v.size(), before);
+    auto held = hold();
+    ownList(list);
+    for (int i = 0; i < list->count; i++)
+        listAt(list, i) = v[i];
 }
 
 string toString(Object m);
@@ -231,9 +406,9 @@ string toString(Object m);
 string listToString(List* list) {
     string str;
     str = "[ ";
-    for (ListNode* it = list->head; it != nullptr; it = it->next) {
-        str += toString(it->info);
-        if (it->next != nullptr) 
+    for (int i = 0; i < listSize(list); i++) {
+        str += toString(listGet(list, i));
+        if (i + 1 < listSize(list))
             str += ", ";
     }
     str += " ]";
@@ -245,8 +420,8 @@ string toString(GCObject* obj) {
     switch (obj->type) {
         case GC_STRING: str = *obj->strval; break;
         case GC_LIST:   str = listToString(obj->listval); break;
-        case GC_STRUCT: str = obj->structval->typeName; break;
-        case GC_FUNC: str = obj->funcval->name; break;
+        case GC_STRUCT: str = obj->structval->type->typeName; break;
+        case GC_FUNC: str = obj->funcval->proto->name; break;
         default:
             str = "(empty)";
     }
@@ -260,16 +435,17 @@ string toString(Object obj) {
         case AS_REAL:   str = to_string(obj.data.realval); break;
         case AS_BOOL:   str = obj.data.boolval ? "true":"false"; break;
         case AS_STRING: str = *(obj.data.gcobj->strval); break;
-        case AS_FUNC:   str = obj.data.gcobj->funcval->name; break;
+        case AS_FUNC:   str = obj.data.gcobj->funcval->proto->name; break;
         case AS_REF:    str = "<" + obj.data.reference->identifier + ">"; break;
         case AS_NULL:   str = "(null)"; break;
         case AS_LIST: {
             str = listToString(obj.data.gcobj->listval);
         } break;
         case AS_STRUCT: {
-            str = obj.data.gcobj->structval->typeName + " {";
-            for (auto m : obj.data.gcobj->structval->fields) {
-                str += m.first +": " + toString(m.second) + ", ";
+            Struct* st = obj.data.gcobj->structval;
+            str = st->type->typeName + " {";
+            for (int i = 0; i < st->fields.size(); i++) {
+                str += st->type->fieldNames[i] +": " + toString(st->fields[i]) + ", ";
             }
             str += "}";
         } break;
@@ -334,12 +510,17 @@ Object makeNumber(double val) {
     return makeReal(val);
 }
 
+// Decodes a numeric literal, integral values come back as ints.
+Object parseNumber(const string& text) {
+    return makeNumber(stod(text));
+}
+
 Object makeBool(bool val) {
     return Object(val);
 }
 
-Object makeReference(string id, int scope) {
-    return Object(new WeakRef(id, scope));
+Object makeReference(string id, int scope, int slot = -1) {
+    return Object(new WeakRef(id, scope, slot));
 }
 
 Object makeNil() {
@@ -0,0 +1,359 @@
+#ifndef optimizer_hpp
+#define optimizer_hpp
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <iomanip>
+#include "ast.hpp"
+#include "object.hpp"
+using namespace std;
+
+/*
+    Runs on the resolved AST before any engine sees it. Folds operators
+    whose operands are all literals into a single literal, and replaces
+    reads of local variables bound once by a top level `let x := <literal>`
+    of their scope, and never written afterwards, with that literal. Globals
+    are left alone, any later line or function may assign them by name.
+    String bindings are too: a string can be changed in place through the
+    variable or anything sharing it, which no assignment to it would show.
+*/
+class ASTOptimizer {
+    private:
+        typedef pair<astnode*, int> VarKey;
+        vector<astnode*> owners;
+        map<VarKey, astnode*> constants;
+        set<VarKey> written;
+        int nesting;
+        int substituted;
+        bool isLiteral(astnode* node);
+        Object literalValue(astnode* node);
+        string literalText(astnode* node);
+        void makeLiteral(astnode* node, Symbol symbol, string text);
+        bool makeLiteral(astnode* node, Object value);
+        VarKey keyOf(astnode* id);
+        void markWritten(astnode* node);
+        void markCaptures(astnode* captures);
+        void fold(astnode* node);
+        void foldUnary(astnode* node);
+        void foldBinary(astnode* node);
+        void foldTypeOf(astnode* node);
+        void collect(astnode* node);
+        void propagate(astnode* node);
+    public:
+        ASTOptimizer();
+        astnode* optimize(astnode* node);
+};
+
+ASTOptimizer::ASTOptimizer() {
+    nesting = 0;
+    substituted = 0;
+}
+
+astnode* ASTOptimizer::optimize(astnode* node) {
+    do {
+        fold(node);
+        owners.clear();
+        constants.clear();
+        written.clear();
+        nesting = 0;
+        collect(node);
+        for (VarKey key : written)
+            constants.erase(key);
+        substituted = 0;
+        propagate(node);
+    } while (substituted > 0);
+    return node;
+}
+
+bool ASTOptimizer::isLiteral(astnode* node) {
+    if (!isExprType(node, CONST_EXPR))
+        return false;
+    switch (node->token.symbol) {
+        case TK_NUM:
+        case TK_STR:
+        case TK_TRUE:
+        case TK_FALSE:
+        case TK_NIL:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+// Decodes the same way the engines do when they execute the literal.
+Object ASTOptimizer::literalValue(astnode* node) {
+    switch (node->token.symbol) {
+        case TK_NUM:   return parseNumber(node->token.strval);
+        case TK_TRUE:  return makeBool(true);
+        case TK_FALSE: return makeBool(false);
+        default:
+            break;
+    }
+    return makeNil();
+}
+
+string ASTOptimizer::literalText(astnode* node) {
+    if (node->token.symbol == TK_STR)
+        return node->token.strval;
+    return toString(literalValue(node));
+}
+
+void ASTOptimizer::makeLiteral(astnode* node, Symbol symbol, string text) {
+    for (int i = 0; i < MAX_CHILD; i++) {
+        cleanUpTree(node->child[i]);
+        node->child[i] = nullptr;
+    }
+    node->type.expr = CONST_EXPR;
+    node->token = Token(symbol, text);
+}
+
+// Only values that survive a round trip through a literal are folded, reals
+// are written with enough digits for parseNumber to give back the same double.
+bool ASTOptimizer::makeLiteral(astnode* node, Object value) {
+    switch (value.type) {
+        case AS_INT:  makeLiteral(node, TK_NUM, to_string(value.data.intval)); return true;
+        case AS_REAL: {
+            ostringstream text;
+            text<<setprecision(17)<<value.data.realval;
+            makeLiteral(node, TK_NUM, text.str());
+        } return true;
+        case AS_BOOL: makeLiteral(node, value.data.boolval ? TK_TRUE:TK_FALSE, value.data.boolval ? "true":"false"); return true;
+        case AS_NULL: makeLiteral(node, TK_NIL, "nil"); return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+void ASTOptimizer::fold(astnode* node) {
+    if (node == nullptr)
+        return;
+    for (int i = 0; i < MAX_CHILD; i++)
+        fold(node->child[i]);
+    if (node->nk == EXPR_NODE) {
+        switch (node->type.expr) {
+            case UNOP_EXPR: foldUnary(node); break;
+            case BINOP_EXPR:
+            case RELOP_EXPR: foldBinary(node); break;
+            case CONST_EXPR: if (node->token.symbol == TK_TYPEOF) foldTypeOf(node); break;
+            default:
+                break;
+        }
+    }
+    fold(node->next);
+}
+
+void ASTOptimizer::foldUnary(astnode* node) {
+    astnode* operand = node->child[0];
+    if (node->token.symbol == TK_SUB && isLiteral(operand) && operand->token.symbol == TK_NUM) {
+        makeLiteral(node, neg(literalValue(operand)));
+    } else if (node->token.symbol == TK_NOT && isLiteral(operand) &&
+              (operand->token.symbol == TK_TRUE || operand->token.symbol == TK_FALSE)) {
+        makeLiteral(node, makeBool(operand->token.symbol == TK_FALSE));
+    }
+}
+
+void ASTOptimizer::foldBinary(astnode* node) {
+    astnode* l = node->child[0];
+    astnode* r = node->child[1];
+    if (!isLiteral(l) || !isLiteral(r))
+        return;
+    if (l->token.symbol == TK_STR || r->token.symbol == TK_STR) {
+        string lhs = literalText(l);
+        string rhs = literalText(r);
+        switch (node->token.symbol) {
+            case TK_ADD: makeLiteral(node, TK_STR, lhs + rhs); break;
+            case TK_LT:  makeLiteral(node, makeBool(lhs < rhs)); break;
+            case TK_LTE: makeLiteral(node, makeBool(lhs <= rhs)); break;
+            case TK_GT:  makeLiteral(node, makeBool(lhs > rhs)); break;
+            case TK_GTE: makeLiteral(node, makeBool(lhs >= rhs)); break;
+            case TK_EQU: makeLiteral(node, makeBool(lhs == rhs)); break;
+            case TK_NEQ: makeLiteral(node, makeBool(lhs != rhs)); break;
+            default:
+                break;
+        }
+        return;
+    }
+    Object lhs = literalValue(l);
+    Object rhs = literalValue(r);
+    switch (node->token.symbol) {
+        case TK_ADD: makeLiteral(node, add(lhs, rhs)); break;
+        case TK_SUB: makeLiteral(node, sub(lhs, rhs)); break;
+        case TK_MUL: makeLiteral(node, mul(lhs, rhs)); break;
+        case TK_POW: makeLiteral(node, pow(lhs, rhs)); break;
+        // leave the divide by zero error (or crash) to run time
+        case TK_DIV: if (getPrimitive(rhs) != 0) makeLiteral(node, div(lhs, rhs)); break;
+        case TK_MOD: if ((int)getPrimitive(rhs) != 0) makeLiteral(node, mod(lhs, rhs)); break;
+        case TK_LT:  makeLiteral(node, lt(lhs, rhs)); break;
+        case TK_LTE: makeLiteral(node, lte(lhs, rhs)); break;
+        case TK_GT:  makeLiteral(node, gt(lhs, rhs)); break;
+        case TK_GTE: makeLiteral(node, gte(lhs, rhs)); break;
+        case TK_EQU: makeLiteral(node, equ(lhs, rhs)); break;
+        case TK_NEQ: makeLiteral(node, neq(lhs, rhs)); break;
+        default:
+            break;
+    }
+}
+
+void ASTOptimizer::foldTypeOf(astnode* node) {
+    astnode* operand = node->child[0];
+    if (!isLiteral(operand))
+        return;
+    string name = "nil";
+    switch (operand->token.symbol) {
+        case TK_NUM:   name = literalValue(operand).type == AS_INT ? "integer":"real"; break;
+        case TK_STR:   name = "string"; break;
+        case TK_TRUE:
+        case TK_FALSE: name = "boolean"; break;
+        default:
+            break;
+    }
+    makeLiteral(node, TK_STR, name);
+}
+
+ASTOptimizer::VarKey ASTOptimizer::keyOf(astnode* id) {
+    int depth = id->token.depth;
+    if (depth < 0 || depth >= owners.size() || id->token.slot < 0)
+        return VarKey(nullptr, -1);
+    return VarKey(owners[owners.size() - 1 - depth], id->token.slot);
+}
+
+// Anything that could write the variable named by node, or bind a ref to it.
+void ASTOptimizer::markWritten(astnode* node) {
+    if (isExprType(node, ID_EXPR))
+        written.insert(keyOf(node));
+}
+
+// A closure's body reaches what it captured as upvalues, which keyOf()
+// can't place, so anything captured counts as written where it's captured.
+void ASTOptimizer::markCaptures(astnode* captures) {
+    for (astnode* it = captures; it != nullptr; it = it->next)
+        markWritten(it);
+}
+
+void ASTOptimizer::collect(astnode* node) {
+    if (node == nullptr)
+        return;
+    if (node->nk == STMT_NODE) {
+        switch (node->type.stmt) {
+            case BLOCK_STMT:
+                if (node->scopeSize == NO_SCOPE) {
+                    collect(node->child[0]);
+                    break;
+                }
+                // fall through, a block with a record of its own owns its locals
+            case FUNC_DEF_STMT: {
+                int saved = nesting;
+                if (isStmtType(node, FUNC_DEF_STMT))
+                    markCaptures(node->child[2]);
+                owners.push_back(node);
+                nesting = 0;
+                for (int i = 0; i < 2; i++)
+                    collect(node->child[i]);
+                nesting = saved;
+                owners.pop_back();
+            } break;
+            case IF_STMT:
+            case WHILE_STMT: {
+                collect(node->child[0]);
+                nesting++;
+                collect(node->child[1]);
+                collect(node->child[2]);
+                nesting--;
+            } break;
+            case STRUCT_DEF_STMT:
+                break;
+            case LET_STMT: {
+                astnode* assign = node->child[0];
+                if (!owners.empty() && nesting == 0 && isExprType(assign, ASSIGN_EXPR) &&
+                    isExprType(assign->child[0], ID_EXPR) && isLiteral(assign->child[1]) &&
+                    assign->child[1]->token.symbol != TK_STR) {
+                    VarKey key = keyOf(assign->child[0]);
+                    if (key.first != nullptr) {
+                        if (constants.find(key) != constants.end())
+                            written.insert(key);
+                        constants[key] = assign->child[1];
+                    }
+                    collect(assign->child[1]);
+                } else {
+                    collect(node->child[0]);
+                }
+            } break;
+            default:
+                for (int i = 0; i < MAX_CHILD; i++)
+                    collect(node->child[i]);
+                break;
+        }
+    } else {
+        switch (node->type.expr) {
+            case ASSIGN_EXPR: markWritten(node->child[0]); break;
+            case REF_EXPR: markWritten(node->child[0]); break;
+            case UNOP_EXPR:
+                if (node->token.symbol == TK_POST_INC || node->token.symbol == TK_POST_DEC)
+                    markWritten(node->child[0]);
+                break;
+            case FUNC_EXPR:
+                for (astnode* it = node->child[1]; it != nullptr; it = it->next)
+                    markWritten(it);
+                break;
+            default:
+                break;
+        }
+        if (isExprType(node, LAMBDA_EXPR)) {
+            int saved = nesting;
+            markCaptures(node->child[2]);
+            owners.push_back(node);
+            nesting = 0;
+            for (int i = 0; i < 2; i++)
+                collect(node->child[i]);
+            nesting = saved;
+            owners.pop_back();
+        } else {
+            for (int i = 0; i < MAX_CHILD; i++)
+                collect(node->child[i]);
+        }
+    }
+    collect(node->next);
+}
+
+void ASTOptimizer::propagate(astnode* node) {
+    if (node == nullptr)
+        return;
+    bool owner = isStmtType(node, FUNC_DEF_STMT) || (isStmtType(node, BLOCK_STMT) && node->scopeSize != NO_SCOPE) || isExprType(node, LAMBDA_EXPR);
+    if (owner)
+        owners.push_back(node);
+    if (isStmtType(node, STRUCT_DEF_STMT)) {
+        // field declarations aren't variable reads
+    } else if (isStmtType(node, LET_STMT) && isExprType(node->child[0], ASSIGN_EXPR)) {
+        propagate(node->child[0]->child[1]);
+    } else if (isExprType(node, ASSIGN_EXPR)) {
+        if (!isExprType(node->child[0], ID_EXPR))
+            propagate(node->child[0]);
+        propagate(node->child[1]);
+    } else if (isExprType(node, FUNC_EXPR)) {
+        for (astnode* it = node->child[1]; it != nullptr; it = it->next)
+            if (!isExprType(it, ID_EXPR))
+                propagate(it);
+    } else if (isExprType(node, REF_EXPR)) {
+    } else if (isExprType(node, UNOP_EXPR) && (node->token.symbol == TK_POST_INC || node->token.symbol == TK_POST_DEC)) {
+    } else if (isStmtType(node, FUNC_DEF_STMT) || isExprType(node, LAMBDA_EXPR)) {
+        propagate(node->child[1]);
+    } else if (isExprType(node, ID_EXPR)) {
+        auto it = constants.find(keyOf(node));
+        if (it != constants.end()) {
+            node->type.expr = CONST_EXPR;
+            node->token = Token(it->second->token.symbol, it->second->token.strval);
+            substituted++;
+        }
+    } else {
+        for (int i = 0; i < MAX_CHILD; i++)
+            propagate(node->child[i]);
+    }
+    if (owner)
+        owners.pop_back();
+    propagate(node->next);
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef parallel_hpp
+#define parallel_hpp
+#include <functional>
+#include <thread>
+#include <vector>
+#include "context.hpp"
+#include "object.hpp"
+#include "threadpool.hpp"
+using namespace std;
+
+/*
+    map, filter and reduce over a long enough list split it into one chunk
+    per pool thread when the callback is pure (purity.hpp). Each chunk runs
+    on a worker VM built from the calling one: its own operand stack, call
+    stack and allocator, reading the caller's globals and closures, which
+    nothing writes while the workers run since the callback can't and the
+    caller is waiting on them. Workers never collect; once they're done the
+    caller's allocator adopts everything they allocated.
+
+    Before handing func to workers the VM's prepareParallel() fills in the
+    caches it would otherwise fill in lazily on first use (interned
+    literals, field caches), so the workers only ever read them.
+*/
+struct ParallelConfig {
+    int threshold;  // smallest list worth splitting, 0 turns it off
+    int threads;
+};
+
+ParallelConfig& parallelConfig() {
+    static ParallelConfig config = { 10000, max((int)thread::hardware_concurrency(), 1) };
+    return config;
+}
+
+ThreadPool& threadPool() {
+    static ThreadPool pool(parallelConfig().threads);
+    return pool;
+}
+
+template <class VM>
+bool runsInParallel(VM& vm, List* list, Object func) {
+    ParallelConfig& config = parallelConfig();
+    if (config.threshold <= 0 || config.threads < 2 || listSize(list) < config.threshold)
+        return false;
+    if (func.type != AS_FUNC || !getFunction(func)->proto->pure)
+        return false;
+    vm.prepareParallel(func);
+    return true;
+}
+
+int chunksFor(List* list) {
+    return min(threadPool().size(), listSize(list));
+}
+
+// Runs body(worker, chunk, from, to) for each chunk [from, to) of [0, n) on
+// its own worker VM, and waits for all of them.
+template <class VM, class Body>
+void forEachChunk(VM& vm, int n, int chunks, Body body) {
+    vector<VM*> workers;
+    vector<function<void()>> tasks;
+    for (int c = 0; c < chunks; c++) {
+        VM* worker = new VM(&vm);
+        int from = (long long)n * c / chunks;
+        int to = (long long)n * (c + 1) / chunks;
+        workers.push_back(worker);
+        tasks.push_back([worker, c, from, to, &body]() { body(*worker, c, from, to); });
+    }
+    threadPool().run(tasks);
+    for (VM* worker : workers) {
+        vm.context().getAlloc().adopt(worker->context().getAlloc());
+        delete worker;
+    }
+}
+
+template <class VM>
+Object parallelMap(VM& vm, List* list, Object func) {
+    vector<Object> results(listSize(list));
+    forEachChunk(vm, listSize(list), chunksFor(list), [&](VM& worker, int, int from, int to) {
+        for (int i = from; i < to; i++) {
+            Object arg = listGet(list, i);
+            results[i] = worker.invoke(func, &arg, 1);
+        }
+    });
+    List* result = new List();
+    for (Object& m : results)
+        appendList(result, m);
+    return vm.context().getAlloc().makeList(result);
+}
+
+template <class VM>
+Object parallelFilter(VM& vm, List* list, Object func) {
+    int chunks = chunksFor(list);
+    vector<vector<Object>> kept(chunks);
+    forEachChunk(vm, listSize(list), chunks, [&](VM& worker, int chunk, int from, int to) {
+        for (int i = from; i < to; i++) {
+            Object arg = listGet(list, i);
+            if (worker.invoke(func, &arg, 1).data.boolval)
+                kept[chunk].push_back(arg);
+        }
+    });
+    List* result = new List();
+    for (vector<Object>& part : kept) {
+        for (Object& m : part)
+            appendList(result, m);
+    }
+    return vm.context().getAlloc().makeList(result);
+}
+
+// Each chunk is reduced on its own and the partial results are then reduced
+// in order, so func has to be associative; it needn't be commutative.
+template <class VM>
+Object parallelReduce(VM& vm, List* list, Object func) {
+    int chunks = chunksFor(list);
+    vector<Object> partial(chunks);
+    forEachChunk(vm, listSize(list), chunks, [&](VM& worker, int chunk, int from, int to) {
+        Object args[2];
+        args[0] = listGet(list, from);
+        for (int i = from + 1; i < to; i++) {
+            args[1] = listGet(list, i);
+            args[0] = worker.invoke(func, args, 2);
+        }
+        partial[chunk] = args[0];
+    });
+    IndexedStack<Object>& roots = vm.context().getOperandStack();
+    for (Object& m : partial)
+        roots.push(m);
+    Object args[2];
+    args[0] = partial[0];
+    for (int c = 1; c < chunks; c++) {
+        args[1] = partial[c];
+        args[0] = vm.invoke(func, args, 2);
+    }
+    for (int c = 0; c < chunks; c++)
+        roots.pop();
+    return args[0];
+}
+
+#endif
@@ -396,6 +396,10 @@ astnode* Parser::primary() {
         node->child[0] = expression();
         match(TK_COMA);
         node->child[1] = expression();
+        if (node->token.symbol == TK_REDUCE && expect(TK_COMA)) {
+            match(TK_COMA);
+            node->child[2] = expression();
+        }
         match(TK_RP);
     } else if (expect(TK_SIZE) || expect(TK_EMPTY) || expect(TK_FIRST) || expect(TK_REST)) {
         node = makeExprNode(LIST_EXPR, current());
@@ -0,0 +1,136 @@
+#ifndef peephole_hpp
+#define peephole_hpp
+#include <iostream>
+#include <vector>
+#include "bytecode.hpp"
+using namespace std;
+
+/*
+    Rewrites the stack vm's most common instruction sequences into single
+    fused instructions:
+
+      LOAD x; DUP; INCR n; STORE x; POP       ->  INCR_VAR x n        (x++ as a statement)
+      LOAD x; CONST k; ADD; STORE x           ->  ADD_VAR_K x k       (x := x + k)
+      LOAD x; CONST k; <relop>; JUMP_FALSE L  ->  CMP_K_JUMP L x k relop
+      <relop>; JUMP_FALSE L                   ->  CMP_JUMP L relop
+      LOAD l; LOAD i; INDEX                   ->  LOAD_INDEXED l i
+
+    A sequence is only fused when nothing jumps into the middle of it, and
+    jump targets are renumbered after the code has been compacted.
+*/
+class PeepholeOptimizer {
+    private:
+        int fired[5];
+        bool isJump(int op);
+        bool isRelop(int op);
+        bool sameVar(Instruction& x, Instruction& y);
+        void optimizeCode(CodeObject* code);
+    public:
+        PeepholeOptimizer();
+        ~PeepholeOptimizer();
+        void optimize(CodeObject* code);
+        void report();
+};
+
+PeepholeOptimizer::PeepholeOptimizer() {
+    for (int i = 0; i < 5; i++)
+        fired[i] = 0;
+}
+
+PeepholeOptimizer::~PeepholeOptimizer() {
+#ifdef OWL_PEEPHOLE_STATS
+    report();
+#endif
+}
+
+void PeepholeOptimizer::report() {
+    cerr<<"[peephole] INCR_VAR: "<<fired[0]<<", ADD_VAR_K: "<<fired[1]<<", CMP_K_JUMP: "<<fired[2];
+    cerr<<", CMP_JUMP: "<<fired[3]<<", LOAD_INDEXED: "<<fired[4]<<endl;
+}
+
+bool PeepholeOptimizer::isJump(int op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_FALSE:
+        case OP_JUMP_FALSE_KEEP:
+        case OP_JUMP_TRUE_KEEP:
+        case OP_CMP_JUMP:
+        case OP_CMP_K_JUMP:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+bool PeepholeOptimizer::isRelop(int op) {
+    return op >= OP_LT && op <= OP_NEQ;
+}
+
+bool PeepholeOptimizer::sameVar(Instruction& x, Instruction& y) {
+    return x.a == y.a && x.b == y.b;
+}
+
+void PeepholeOptimizer::optimize(CodeObject* code) {
+    optimizeCode(code);
+    for (CodeObject* func : code->functions)
+        optimize(func);
+}
+
+void PeepholeOptimizer::optimizeCode(CodeObject* code) {
+    vector<Instruction>& in = code->code;
+    int n = in.size();
+    vector<bool> target(n + 1, false);
+    for (Instruction& ins : in) {
+        if (isJump(ins.op))
+            target[ins.a] = true;
+    }
+    // nothing may jump past the first instruction of a pattern
+    auto straight = [&](int i, int len) {
+        if (i + len > n)
+            return false;
+        for (int j = i + 1; j < i + len; j++)
+            if (target[j])
+                return false;
+        return true;
+    };
+    vector<Instruction> out;
+    vector<int> remap(n + 1, 0);
+    int i = 0;
+    while (i < n) {
+        Instruction& x = in[i];
+        int len = 1;
+        Instruction fused = x;
+        if (x.op == OP_LOAD && straight(i, 5) && in[i+1].op == OP_DUP && in[i+2].op == OP_INCR &&
+            in[i+3].op == OP_STORE && sameVar(x, in[i+3]) && in[i+4].op == OP_POP) {
+            fused = Instruction(OP_INCR_VAR, x.a, x.b, in[i+2].a);
+            len = 5; fired[0]++;
+        } else if (x.op == OP_LOAD && straight(i, 4) && in[i+1].op == OP_CONST && in[i+2].op == OP_ADD &&
+                   in[i+3].op == OP_STORE && sameVar(x, in[i+3])) {
+            fused = Instruction(OP_ADD_VAR_K, x.a, x.b, in[i+1].a);
+            len = 4; fired[1]++;
+        } else if (x.op == OP_LOAD && straight(i, 4) && in[i+1].op == OP_CONST && isRelop(in[i+2].op) &&
+                   in[i+3].op == OP_JUMP_FALSE) {
+            fused = Instruction(OP_CMP_K_JUMP, in[i+3].a, x.a, x.b, in[i+1].a, in[i+2].op);
+            len = 4; fired[2]++;
+        } else if (isRelop(x.op) && straight(i, 2) && in[i+1].op == OP_JUMP_FALSE) {
+            fused = Instruction(OP_CMP_JUMP, in[i+1].a, x.op);
+            len = 2; fired[3]++;
+        } else if (x.op == OP_LOAD && straight(i, 3) && in[i+1].op == OP_LOAD && in[i+2].op == OP_INDEX) {
+            fused = Instruction(OP_LOAD_INDEXED, x.a, x.b, in[i+1].a, in[i+1].b, in[i+2].a);
+            len = 3; fired[4]++;
+        }
+        for (int j = i; j < i + len; j++)
+            remap[j] = out.size();
+        out.push_back(fused);
+        i += len;
+    }
+    remap[n] = out.size();
+    for (Instruction& ins : out) {
+        if (isJump(ins.op))
+            ins.a = remap[ins.a];
+    }
+    in = out;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef purity_hpp
+#define purity_hpp
+#include "ast.hpp"
+#include "globals.hpp"
+using namespace std;
+
+/*
+    Decides from the resolved AST whether a function can be run on another
+    thread: it may only assign its own params and locals, and may not print,
+    call anything but itself (_rc), create closures, define functions or
+    types, take references, or mutate a list in place (append, push, sort,
+    subscript assignment). Reading captured variables and globals, and
+    allocating new values, is fine.
+
+    Locals are told apart from captured variables by the depth the resolver
+    gave them: inside the function body an assignment target with a depth
+    no greater than the number of scopes opened since the function's own
+    is declared by the function.
+*/
+class PurityChecker {
+    private:
+        int level;
+        bool isLocal(astnode* id);
+        bool checkExpr(astnode* node);
+        bool checkStmt(astnode* node);
+        bool check(astnode* node);
+    public:
+        PurityChecker();
+        bool isPure(astnode* params, astnode* body);
+};
+
+PurityChecker::PurityChecker() {
+    level = 0;
+}
+
+bool PurityChecker::isPure(astnode* params, astnode* body) {
+    for (astnode* it = params; it != nullptr; it = it->next) {
+        if (isExprType(it, REF_EXPR))
+            return false;
+    }
+    level = 0;
+    return check(body);
+}
+
+bool PurityChecker::isLocal(astnode* id) {
+    return isExprType(id, ID_EXPR) && id->token.depth >= 0 && id->token.depth <= level;
+}
+
+bool PurityChecker::check(astnode* node) {
+    for (astnode* it = node; it != nullptr; it = it->next) {
+        bool ok = it->nk == STMT_NODE ? checkStmt(it):checkExpr(it);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+bool PurityChecker::checkStmt(astnode* node) {
+    switch (node->type.stmt) {
+        case PRINT_STMT:
+        case FUNC_DEF_STMT:
+        case STRUCT_DEF_STMT:
+            return false;
+        case BLOCK_STMT: {
+            int scoped = node->scopeSize != NO_SCOPE;
+            level += scoped;
+            bool ok = check(node->child[0]);
+            level -= scoped;
+            return ok;
+        }
+        default:
+            break;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (!check(node->child[i]))
+            return false;
+    }
+    return true;
+}
+
+bool PurityChecker::checkExpr(astnode* node) {
+    switch (node->type.expr) {
+        case LAMBDA_EXPR:
+        case REF_EXPR:
+        case REG_EXPR:
+        case ZF_EXPR:
+            return false;
+        case ASSIGN_EXPR:
+            if (!isLocal(node->child[0]))
+                return false;
+            return check(node->child[1]);
+        case UNOP_EXPR:
+            if ((node->token.symbol == TK_POST_INC || node->token.symbol == TK_POST_DEC) && !isLocal(node->child[0]))
+                return false;
+            break;
+        case FUNC_EXPR:
+            if (!isExprType(node->child[0], ID_EXPR) || node->child[0]->token.depth != CURRENT_FUNCTION_DEPTH)
+                return false;
+            return check(node->child[1]);
+        case LIST_EXPR:
+            switch (node->token.symbol) {
+                case TK_APPEND: case TK_PUSH: case TK_SORT:
+                case TK_MAP: case TK_FILTER: case TK_REDUCE:
+                    return false;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (!check(node->child[i]))
+            return false;
+    }
+    return true;
+}
+
+#endif
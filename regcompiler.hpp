@@ -0,0 +1,605 @@
+#ifndef regcompiler_hpp
+#define regcompiler_hpp
+#include <iostream>
+#include <vector>
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "purity.hpp"
+using namespace std;
+
+/*
+    Compiles the resolved AST to three address code for the register vm.
+    Every scope the resolver opened (function, lambda, block) is a unit with
+    its own register window: slots [0, scopeSize) hold the variables the
+    resolver numbered, temporaries are handed out above them stack-wise and
+    released once the expression needing them has been emitted.
+*/
+class RegisterCompiler {
+    private:
+        struct Unit {
+            int locals;
+            int next;
+            int maxRegs;
+            Unit(int n = 0) : locals(n), next(n), maxRegs(n) { }
+        };
+        CodeObject* code;
+        vector<Unit> units;
+        int emit(int op, int a = 0, int b = 0, int c = 0, int d = 0);
+        int here();
+        int constant(Object obj);
+        int K(Object obj);
+        int stringIndex(string str);
+        int allocTemp();
+        void releaseTo(int mark);
+        int mark();
+        bool isVariable(int reg);
+        bool isLocal(astnode* node);
+        bool hasSideEffects(astnode* node);
+        CodeObject* compileFunction(string name, astnode* params, astnode* body, astnode* captures, int scopeSize);
+        void compileStatementList(astnode* node);
+        void compileStatement(astnode* node);
+        void compileExprStatement(astnode* node);
+        void compileBlock(astnode* node);
+        void compileFuncDef(astnode* node);
+        void compileStructDef(astnode* node);
+        void compileAssign(astnode* node, int dest);
+        void storeVariable(astnode* var, int rk);
+        int branchUnless(astnode* cond);
+        int operand(astnode* node);
+        void exprTo(astnode* node, int dest);
+        void constTo(astnode* node, int dest);
+        void variableTo(astnode* node, int dest);
+        void unaryTo(astnode* node, int dest);
+        void binaryTo(astnode* node, int dest);
+        void logicTo(astnode* node, int dest);
+        void ternaryTo(astnode* node, int dest);
+        void callTo(astnode* node, int dest);
+        void listTo(astnode* node, int dest);
+    public:
+        RegisterCompiler();
+        CodeObject* compile(astnode* node);
+};
+
+RegisterCompiler::RegisterCompiler() {
+    code = nullptr;
+}
+
+CodeObject* RegisterCompiler::compile(astnode* node) {
+    code = new CodeObject("(toplevel)", true);
+    units.clear();
+    units.push_back(Unit(0));
+    compileStatementList(node);
+    emit(R_HALT);
+    code->frameSize = units.back().maxRegs;
+    units.pop_back();
+    return code;
+}
+
+int RegisterCompiler::emit(int op, int a, int b, int c, int d) {
+    code->code.push_back(Instruction(op, a, b, c, d));
+    return code->code.size() - 1;
+}
+
+int RegisterCompiler::here() {
+    return code->code.size();
+}
+
+int RegisterCompiler::constant(Object obj) {
+    for (int i = 0; i < code->constants.size(); i++) {
+        Object& k = code->constants[i];
+        if (k.type != obj.type)
+            continue;
+        switch (k.type) {
+            case AS_INT:  if (k.data.intval == obj.data.intval) return i; break;
+            case AS_REAL: if (k.data.realval == obj.data.realval) return i; break;
+            case AS_BOOL: if (k.data.boolval == obj.data.boolval) return i; break;
+            case AS_NULL: return i;
+            default:
+                break;
+        }
+    }
+    code->constants.push_back(obj);
+    return code->constants.size() - 1;
+}
+
+int RegisterCompiler::K(Object obj) {
+    return -1 - constant(obj);
+}
+
+int RegisterCompiler::stringIndex(string str) {
+    for (int i = 0; i < code->strings.size(); i++)
+        if (code->strings[i] == str)
+            return i;
+    code->strings.push_back(str);
+    return code->strings.size() - 1;
+}
+
+int RegisterCompiler::allocTemp() {
+    Unit& unit = units.back();
+    int reg = unit.next++;
+    if (unit.next > unit.maxRegs)
+        unit.maxRegs = unit.next;
+    return reg;
+}
+
+int RegisterCompiler::mark() {
+    return units.back().next;
+}
+
+void RegisterCompiler::releaseTo(int mark) {
+    units.back().next = mark;
+}
+
+bool RegisterCompiler::isVariable(int reg) {
+    return reg >= 0 && reg < units.back().locals;
+}
+
+bool RegisterCompiler::isLocal(astnode* node) {
+    return isExprType(node, ID_EXPR) && node->token.depth == 0 && node->token.slot >= 0 && !node->token.captured;
+}
+
+// Conservative: could evaluating node change the value of a local read before it?
+bool RegisterCompiler::hasSideEffects(astnode* node) {
+    if (node == nullptr)
+        return false;
+    if (node->nk == EXPR_NODE) {
+        switch (node->type.expr) {
+            case ASSIGN_EXPR:
+            case FUNC_EXPR:
+            case LIST_EXPR:
+            case ZF_EXPR:
+                return true;
+            case UNOP_EXPR:
+                if (node->token.symbol == TK_POST_INC || node->token.symbol == TK_POST_DEC)
+                    return true;
+                break;
+            case LAMBDA_EXPR:
+                return false;
+            default:
+                break;
+        }
+    }
+    for (int i = 0; i < MAX_CHILD; i++)
+        if (hasSideEffects(node->child[i]))
+            return true;
+    return false;
+}
+
+CodeObject* RegisterCompiler::compileFunction(string name, astnode* params, astnode* body, astnode* captures, int scopeSize) {
+    CodeObject* enclosing = code;
+    code = new CodeObject(name, true);
+    code->pure = PurityChecker().isPure(params, body);
+    for (astnode* it = captures; it != nullptr; it = it->next)
+        code->captures.push_back(make_pair(it->token.depth, it->token.slot));
+    for (astnode* it = params; it != nullptr; it = it->next) {
+        if (isExprType(it, REF_EXPR)) {
+            code->params.push_back(it->child[0]->token.strval);
+            code->refParams.push_back(true);
+        } else {
+            code->params.push_back(it->token.strval);
+            code->refParams.push_back(false);
+        }
+    }
+    units.push_back(Unit(scopeSize));
+    if (body != nullptr && body->nk == EXPR_NODE) {
+        emit(R_RETURN, operand(body));
+    } else {
+        compileStatementList(body);
+        emit(R_RETURN, K(makeNil()));
+    }
+    code->frameSize = units.back().maxRegs;
+    units.pop_back();
+    code->proto = new FunctionProto(name, code, code->frameSize, code->pure);
+    CodeObject* compiled = code;
+    code = enclosing;
+    return compiled;
+}
+
+void RegisterCompiler::compileStatementList(astnode* node) {
+    for (astnode* it = node; it != nullptr; it = it->next) {
+        int m = mark();
+        if (it->nk == STMT_NODE) {
+            compileStatement(it);
+        } else {
+            compileExprStatement(it);
+        }
+        releaseTo(m);
+    }
+}
+
+void RegisterCompiler::compileStatement(astnode* node) {
+    switch (node->type.stmt) {
+        case LET_STMT: {
+            if (isExprType(node->child[0], ID_EXPR)) {
+                storeVariable(node->child[0], K(makeNil()));
+            } else {
+                compileExprStatement(node->child[0]);
+            }
+        } break;
+        case EXPR_STMT: compileExprStatement(node->child[0]); break;
+        case PRINT_STMT: emit(R_PRINT, operand(node->child[0]), node->token.symbol == TK_PRINTLN); break;
+        case IF_STMT: {
+            int jf = branchUnless(node->child[0]);
+            compileStatementList(node->child[1]);
+            if (node->child[2] != nullptr) {
+                int jend = emit(R_JUMP);
+                code->code[jf].a = here();
+                compileStatementList(node->child[2]);
+                code->code[jend].a = here();
+            } else {
+                code->code[jf].a = here();
+            }
+        } break;
+        case WHILE_STMT: {
+            int top = here();
+            int m = mark();
+            int jf = branchUnless(node->child[0]);
+            releaseTo(m);
+            compileStatementList(node->child[1]);
+            emit(R_JUMP, top);
+            code->code[jf].a = here();
+        } break;
+        case BLOCK_STMT: compileBlock(node); break;
+        case RETURN_STMT: emit(R_RETURN, operand(node->child[0])); break;
+        case FUNC_DEF_STMT: compileFuncDef(node); break;
+        case STRUCT_DEF_STMT: compileStructDef(node); break;
+        default:
+            break;
+    }
+}
+
+void RegisterCompiler::compileExprStatement(astnode* node) {
+    if (node == nullptr)
+        return;
+    if (isExprType(node, ASSIGN_EXPR)) {
+        compileAssign(node, -1);
+    } else if (isExprType(node, UNOP_EXPR) && isLocal(node->child[0]) &&
+              (node->token.symbol == TK_POST_INC || node->token.symbol == TK_POST_DEC)) {
+        emit(R_INCR, node->child[0]->token.slot, node->token.symbol == TK_POST_INC ? 1:-1);
+    } else {
+        exprTo(node, allocTemp());
+    }
+}
+
+void RegisterCompiler::compileBlock(astnode* node) {
+    if (node->scopeSize == NO_SCOPE) {
+        compileStatementList(node->child[0]);
+        return;
+    }
+    int enter = emit(R_ENTER_SCOPE);
+    units.push_back(Unit(node->scopeSize));
+    compileStatementList(node->child[0]);
+    code->code[enter].a = units.back().maxRegs;
+    units.pop_back();
+    emit(R_EXIT_SCOPE);
+}
+
+void RegisterCompiler::compileFuncDef(astnode* node) {
+    code->functions.push_back(compileFunction(node->token.strval, node->child[0], node->child[1], node->child[2], node->scopeSize));
+    int k = code->functions.size() - 1;
+    if (node->token.depth == 0 && node->token.slot >= 0 && !node->token.captured) {
+        emit(R_CLOSURE, node->token.slot, k);
+    } else {
+        int t = allocTemp();
+        emit(R_CLOSURE, t, k);
+        storeVariable(node, t);
+    }
+}
+
+void RegisterCompiler::compileStructDef(astnode* node) {
+    StructDef def;
+    def.typeName = node->child[0]->token.strval;
+    for (astnode* it = node->child[1]; it != nullptr; it = it->next) {
+        def.fields.push_back(it->child[0]->token.strval);
+    }
+    code->structs.push_back(def);
+    emit(R_DEF_STRUCT, code->structs.size() - 1);
+}
+
+void RegisterCompiler::storeVariable(astnode* var, int rk) {
+    if (isLocal(var)) {
+        if (var->token.slot != rk)
+            emit(R_MOVE, var->token.slot, rk);
+    } else if (var->token.depth != GLOBAL_SCOPE_DEPTH) {
+        emit(R_SETUP, var->token.depth, var->token.slot, rk);
+    } else {
+        emit(R_SETGLOBAL, var->token.slot, rk);
+    }
+}
+
+// dest < 0 when the value of the assignment isn't used.
+void RegisterCompiler::compileAssign(astnode* node, int dest) {
+    astnode* target = node->child[0];
+    if (isLocal(target)) {
+        exprTo(node->child[1], target->token.slot);
+        if (dest >= 0 && dest != target->token.slot)
+            emit(R_MOVE, dest, target->token.slot);
+    } else if (isExprType(target, ID_EXPR)) {
+        int m = mark();
+        int r = operand(node->child[1]);
+        storeVariable(target, r);
+        if (dest >= 0)
+            emit(R_MOVE, dest, r);
+        releaseTo(m);
+    } else if (isExprType(target, SUBSCRIPT_EXPR)) {
+        int m = mark();
+        int c = operand(target->child[0]);
+        int i = operand(target->child[1]);
+        int v = operand(node->child[1]);
+        emit(R_STORE_INDEX, c, i, v, stringIndex(target->child[1] == nullptr ? "":target->child[1]->token.strval));
+        if (dest >= 0)
+            emit(R_MOVE, dest, v);
+        releaseTo(m);
+    } else {
+        exprTo(node->child[1], dest >= 0 ? dest:allocTemp());
+    }
+}
+
+// Emits a jump, patched by the caller, taken when cond is false. Relational
+// conditions test and branch in one instruction instead of going through a bool.
+int RegisterCompiler::branchUnless(astnode* cond) {
+    if (isExprType(cond, RELOP_EXPR)) {
+        int relop = -1;
+        switch (cond->token.symbol) {
+            case TK_LT:  relop = R_LT; break;
+            case TK_LTE: relop = R_LTE; break;
+            case TK_GT:  relop = R_GT; break;
+            case TK_GTE: relop = R_GTE; break;
+            case TK_EQU: relop = R_EQU; break;
+            case TK_NEQ: relop = R_NEQ; break;
+            default:
+                break;
+        }
+        if (relop != -1) {
+            int l = operand(cond->child[0]);
+            if (isVariable(l) && hasSideEffects(cond->child[1])) {
+                int t = allocTemp();
+                emit(R_MOVE, t, l);
+                l = t;
+            }
+            int r = operand(cond->child[1]);
+            return emit(R_CMP_JUMP, 0, l, r, relop);
+        }
+    }
+    return emit(R_JUMP_FALSE, 0, operand(cond));
+}
+
+int RegisterCompiler::operand(astnode* node) {
+    if (node == nullptr)
+        return K(makeNil());
+    if (isExprType(node, CONST_EXPR)) {
+        switch (node->token.symbol) {
+            case TK_TRUE:  return K(makeBool(true));
+            case TK_FALSE: return K(makeBool(false));
+            case TK_NUM:   return K(parseNumber(node->token.strval));
+            case TK_NIL:   return K(makeNil());
+            default:
+                break;
+        }
+    }
+    if (isLocal(node))
+        return node->token.slot;
+    int t = allocTemp();
+    exprTo(node, t);
+    return t;
+}
+
+void RegisterCompiler::exprTo(astnode* node, int dest) {
+    if (node == nullptr) {
+        emit(R_MOVE, dest, K(makeNil()));
+        return;
+    }
+    int m = mark();
+    switch (node->type.expr) {
+        case CONST_EXPR: constTo(node, dest); break;
+        case ID_EXPR: variableTo(node, dest); break;
+        case UNOP_EXPR: unaryTo(node, dest); break;
+        case BINOP_EXPR:
+        case RELOP_EXPR: binaryTo(node, dest); break;
+        case LOGIC_EXPR: logicTo(node, dest); break;
+        case TERNARY_EXPR: ternaryTo(node, dest); break;
+        case ASSIGN_EXPR: compileAssign(node, dest); break;
+        case FUNC_EXPR: callTo(node, dest); break;
+        case LAMBDA_EXPR: {
+            code->functions.push_back(compileFunction("(lambda)", node->child[0], node->child[1], node->child[2], node->scopeSize));
+            emit(R_CLOSURE, dest, code->functions.size() - 1);
+        } break;
+        case LIST_EXPR: listTo(node, dest); break;
+        case SUBSCRIPT_EXPR: {
+            int c = operand(node->child[0]);
+            if (isExprType(node->child[1], RANGE_EXPR)) {
+                int l = operand(node->child[1]->child[0]);
+                int r = operand(node->child[1]->child[1]);
+                emit(R_SLICE, dest, c, l, r);
+                break;
+            }
+            int i = operand(node->child[1]);
+            emit(R_INDEX, dest, c, i, stringIndex(node->child[1] == nullptr ? "":node->child[1]->token.strval));
+        } break;
+        case RANGE_EXPR: {
+            int l = operand(node->child[0]);
+            int r = operand(node->child[1]);
+            emit(R_RANGE, dest, l, r);
+        } break;
+        case ZF_EXPR: {
+            int l = operand(node->child[0]);
+            int f = operand(node->child[1]);
+            int p = operand(node->child[2]);
+            emit(R_COMPREHEND, dest, l, f, p);
+        } break;
+        case REG_EXPR: {
+            int t = operand(node->child[0]);
+            int p = operand(node->child[1]);
+            emit(R_MATCHRE, dest, t, p);
+        } break;
+        case BLESS_EXPR: emit(R_BLESS, dest, stringIndex(node->child[0]->token.strval)); break;
+        case REF_EXPR: emit(R_DEREF, dest, operand(node->child[0])); break;
+        default:
+            emit(R_MOVE, dest, K(makeNil()));
+            break;
+    }
+    releaseTo(m);
+}
+
+void RegisterCompiler::constTo(astnode* node, int dest) {
+    switch (node->token.symbol) {
+        case TK_STR: emit(R_LOADSTR, dest, stringIndex(node->token.strval), node->shared); break;
+        case TK_TYPEOF: emit(R_TYPEOF, dest, operand(node->child[0])); break;
+        default:
+            emit(R_MOVE, dest, operand(node));
+            break;
+    }
+}
+
+void RegisterCompiler::variableTo(astnode* node, int dest) {
+    if (node->token.depth == CURRENT_FUNCTION_DEPTH) {
+        emit(R_CURRENT_FUNC, dest);
+    } else if (isLocal(node)) {
+        if (dest != node->token.slot)
+            emit(R_MOVE, dest, node->token.slot);
+    } else if (node->token.depth != GLOBAL_SCOPE_DEPTH) {
+        emit(R_GETUP, dest, node->token.depth, node->token.slot);
+    } else {
+        emit(R_GETGLOBAL, dest, node->token.slot);
+    }
+}
+
+void RegisterCompiler::unaryTo(astnode* node, int dest) {
+    switch (node->token.symbol) {
+        case TK_NOT: emit(R_NOT, dest, operand(node->child[0])); break;
+        case TK_SUB: emit(R_NEG, dest, operand(node->child[0])); break;
+        case TK_POST_INC:
+        case TK_POST_DEC: {
+            int step = node->token.symbol == TK_POST_INC ? 1:-1;
+            astnode* var = node->child[0];
+            if (isLocal(var)) {
+                if (dest != var->token.slot)
+                    emit(R_MOVE, dest, var->token.slot);
+                emit(R_INCR, var->token.slot, step);
+            } else if (isExprType(var, ID_EXPR)) {
+                variableTo(var, dest);
+                int t = allocTemp();
+                emit(R_MOVE, t, dest);
+                emit(R_INCR, t, step);
+                storeVariable(var, t);
+            } else {
+                exprTo(var, dest);
+            }
+        } break;
+        default:
+            exprTo(node->child[0], dest);
+            break;
+    }
+}
+
+void RegisterCompiler::binaryTo(astnode* node, int dest) {
+    int l = operand(node->child[0]);
+    if (isVariable(l) && hasSideEffects(node->child[1])) {
+        int t = allocTemp();
+        emit(R_MOVE, t, l);
+        l = t;
+    }
+    int r = operand(node->child[1]);
+    int op = R_ADD;
+    switch (node->token.symbol) {
+        case TK_ADD: op = R_ADD; break;
+        case TK_SUB: op = R_SUB; break;
+        case TK_MUL: op = R_MUL; break;
+        case TK_DIV: op = R_DIV; break;
+        case TK_MOD: op = R_MOD; break;
+        case TK_POW: op = R_POW; break;
+        case TK_LT:  op = R_LT; break;
+        case TK_LTE: op = R_LTE; break;
+        case TK_GT:  op = R_GT; break;
+        case TK_GTE: op = R_GTE; break;
+        case TK_EQU: op = R_EQU; break;
+        case TK_NEQ: op = R_NEQ; break;
+        default:
+            break;
+    }
+    emit(op, dest, l, r);
+}
+
+// Both of these write dest before they're done reading their operands,
+// so when dest is a variable the result is built in a temporary first.
+void RegisterCompiler::logicTo(astnode* node, int dest) {
+    int d = isVariable(dest) ? allocTemp():dest;
+    exprTo(node->child[0], d);
+    int j = emit(node->token.symbol == TK_AND ? R_JUMP_FALSE:R_JUMP_TRUE, 0, d);
+    exprTo(node->child[1], d);
+    code->code[j].a = here();
+    if (d != dest)
+        emit(R_MOVE, dest, d);
+}
+
+void RegisterCompiler::ternaryTo(astnode* node, int dest) {
+    int d = isVariable(dest) ? allocTemp():dest;
+    int jf = branchUnless(node->child[0]);
+    exprTo(node->child[1], d);
+    int jend = emit(R_JUMP);
+    code->code[jf].a = here();
+    exprTo(node->child[2], d);
+    code->code[jend].a = here();
+    if (d != dest)
+        emit(R_MOVE, dest, d);
+}
+
+void RegisterCompiler::callTo(astnode* node, int dest) {
+    int base = allocTemp();
+    exprTo(node->child[0], base);
+    int argc = 0;
+    for (astnode* it = node->child[1]; it != nullptr; it = it->next) {
+        exprTo(it, allocTemp());
+        argc++;
+    }
+    int name = stringIndex(node->child[0] == nullptr ? "(null)":node->child[0]->token.strval);
+    if (node->tail == NOT_TAIL_CALL) {
+        emit(R_CALL, dest, base, argc, name);
+    } else {
+        emit(R_TAIL_CALL, dest, base, argc, name);
+    }
+}
+
+void RegisterCompiler::listTo(astnode* node, int dest) {
+    switch (node->token.symbol) {
+        case TK_LB: {
+            int base = mark();
+            int n = 0;
+            for (astnode* it = node->child[0]; it != nullptr; it = it->next) {
+                exprTo(it, allocTemp());
+                n++;
+            }
+            emit(R_MAKE_LIST, dest, base, n);
+        } break;
+        case TK_SIZE:  emit(R_SIZE, dest, operand(node->child[0])); break;
+        case TK_EMPTY: emit(R_EMPTY, dest, operand(node->child[0])); break;
+        case TK_FIRST: emit(R_FIRST, dest, operand(node->child[0])); break;
+        case TK_REST:  emit(R_REST, dest, operand(node->child[0])); break;
+        case TK_APPEND:
+        case TK_PUSH: {
+            int l = operand(node->child[0]);
+            int v = operand(node->child[1]);
+            emit(node->token.symbol == TK_APPEND ? R_APPEND:R_PUSH, l, v);
+            if (dest != l)
+                emit(R_MOVE, dest, l);
+        } break;
+        case TK_MAP:
+        case TK_FILTER:
+        case TK_REDUCE: {
+            int l = operand(node->child[0]);
+            int f = operand(node->child[1]);
+            int op = node->token.symbol == TK_MAP ? R_MAP:(node->token.symbol == TK_FILTER ? R_FILTER:R_REDUCE);
+            emit(op, dest, l, f, operand(node->child[2]));
+        } break;
+        case TK_SORT: {
+            int l = operand(node->child[0]);
+            int f = operand(node->child[1]);
+            emit(R_SORT, dest, l, f);
+        } break;
+        default:
+            emit(R_MOVE, dest, K(makeNil()));
+            break;
+    }
+}
+
+#endif
@@ -0,0 +1,351 @@
+#ifndef regvm_hpp
+#define regvm_hpp
+#include <iostream>
+#include <vector>
+#include "allocator.hpp"
+#include "ast.hpp"
+#include "builtins.hpp"
+#include "bytecode.hpp"
+#include "regcompiler.hpp"
+#include "context.hpp"
+#include "object.hpp"
+#include "regex/patternmatcher.hpp"
+using namespace std;
+
+struct RegisterFrame {
+    CodeObject* code;
+    int ip;
+    int retReg;
+    Object func;
+    ActivationRecord* savedEnv;
+    RegisterFrame(CodeObject* c = nullptr, int ret = -1, Object f = Object(), ActivationRecord* env = nullptr) : code(c), ip(0), retReg(ret), func(f), savedEnv(env) { }
+};
+
+class RegisterVM {
+    private:
+        bool loud;
+        bool worker;
+        Context cxt;
+        RegisterCompiler compiler;
+        vector<RegisterFrame> frames;
+        vector<Object> tailArgs;
+        Object returnValue;
+        bool compare(int relop, Object& lhs, Object& rhs) {
+            switch (relop) {
+                case R_LT:  return lt(lhs, rhs).data.boolval;
+                case R_LTE: return lte(lhs, rhs).data.boolval;
+                case R_GT:  return gt(lhs, rhs).data.boolval;
+                case R_GTE: return gte(lhs, rhs).data.boolval;
+                case R_EQU: return equ(lhs, rhs).data.boolval;
+                case R_NEQ: return neq(lhs, rhs).data.boolval;
+                default:
+                    break;
+            }
+            return false;
+        }
+        // Shared string literals (see markSharedLiterals) are interned once
+        // per code object; one that was adopted by a mutation gets swapped
+        // for a fresh interned copy.
+        Object& literal(CodeObject* code, int i) {
+            if (code->literals.size() < code->strings.size())
+                code->literals.resize(code->strings.size(), makeNil());
+            Object& k = code->literals[i];
+            if (k.type != AS_STRING || !k.data.gcobj->immortal)
+                k = cxt.getAlloc().internString(code->strings[i]);
+            return k;
+        }
+        // Workers skip the field caches rather than race on them.
+        FieldCache* fieldCache(CodeObject* code, int i) {
+            return worker ? nullptr:code->fieldCache(i);
+        }
+        Object makeFunction(CodeObject* proto) {
+            Function* func = new Function(proto->proto);
+            for (auto & up : proto->captures)
+                func->upvalues.push_back(cxt.capture(up.first, up.second));
+            return cxt.getAlloc().makeFunction(func);
+        }
+        void defineStruct(StructDef& def) {
+            StructType* st = new StructType(def.typeName);
+            for (string& field : def.fields) {
+                st->addField(field);
+            }
+            cxt.addStructType(st);
+        }
+        // Sets up a frame whose register window is a fresh activation record,
+        // params copied into the low slots. retReg is the register in the
+        // calling frame that receives the result, -1 when called from native code.
+        bool callFunction(Object m, Object* args, int argc, int retReg, const string& name) {
+            if (m.type != AS_FUNC || getFunction(m) == nullptr || getFunction(m)->proto->code == nullptr) {
+                cout<<"Couldn't find function named: "<<name<<endl;
+                return false;
+            }
+            Function* func = getFunction(m);
+            CodeObject* proto = func->proto->code;
+            ActivationRecord* env = cxt.callRecord(m, cxt.getCallStack(), proto->frameSize);
+            for (int i = 0; i < argc && i < proto->params.size(); i++) {
+                env->slots[i] = args[i];
+            }
+            frames.push_back(RegisterFrame(proto, retReg, m, cxt.getCallStack()));
+            cxt.openScope(env);
+            return true;
+        }
+        // `return f(...)`: turns the current frame into the callee's instead
+        // of pushing one, so tail recursion runs in constant frames. The
+        // callee takes over the caller's recycled record, the arguments
+        // going through tailArgs since they live in it. Returns false when
+        // it has to be an ordinary call, m not being compiled script code.
+        bool tailCall(Object m, Object* args, int argc, RegisterFrame* frame) {
+            if (m.type != AS_FUNC || getFunction(m) == nullptr || getFunction(m)->proto->code == nullptr)
+                return false;
+            Function* func = getFunction(m);
+            CodeObject* proto = func->proto->code;
+            tailArgs.assign(args, args + min(argc, (int)proto->params.size()));
+            cxt.unwindTo(frame->savedEnv);
+            ActivationRecord* env = cxt.callRecord(m, frame->savedEnv, proto->frameSize);
+            for (int i = 0; i < tailArgs.size(); i++)
+                env->slots[i] = tailArgs[i];
+            frame->code = proto;
+            frame->func = m;
+            cxt.openScope(env);
+            return true;
+        }
+        void run(int stopDepth) {
+            RegisterFrame* frame = &frames.back();
+            Instruction* code = frame->code->code.data();
+            Object* consts = frame->code->constants.data();
+            Object* regs = cxt.getCallStack()->slots.data();
+            int ip = frame->ip;
+            auto rk = [&](int x) -> Object& { return x >= 0 ? regs[x]:consts[-1-x]; };
+#ifdef OWL_THREADED_DISPATCH
+            static void* dispatchTable[] = {
+                &&L_R_MOVE, &&L_R_LOADSTR, &&L_R_GETUP, &&L_R_SETUP, &&L_R_GETGLOBAL, &&L_R_SETGLOBAL,
+                &&L_R_CURRENT_FUNC, &&L_R_ADD, &&L_R_SUB, &&L_R_MUL, &&L_R_DIV, &&L_R_MOD,
+                &&L_R_POW, &&L_R_NEG, &&L_R_NOT, &&L_R_INCR, &&L_R_LT, &&L_R_LTE,
+                &&L_R_GT, &&L_R_GTE, &&L_R_EQU, &&L_R_NEQ, &&L_R_JUMP, &&L_R_JUMP_FALSE,
+                &&L_R_JUMP_TRUE, &&L_R_CMP_JUMP, &&L_R_PRINT, &&L_R_CLOSURE, &&L_R_DEF_STRUCT, &&L_R_CALL,
+                &&L_R_TAIL_CALL, &&L_R_RETURN, &&L_R_ENTER_SCOPE, &&L_R_EXIT_SCOPE, &&L_R_MAKE_LIST, &&L_R_RANGE,
+                &&L_R_INDEX, &&L_R_STORE_INDEX, &&L_R_SLICE, &&L_R_SIZE, &&L_R_EMPTY, &&L_R_APPEND,
+                &&L_R_PUSH, &&L_R_FIRST, &&L_R_REST, &&L_R_MAP, &&L_R_FILTER, &&L_R_REDUCE,
+                &&L_R_SORT, &&L_R_COMPREHEND, &&L_R_MATCHRE, &&L_R_BLESS, &&L_R_DEREF, &&L_R_TYPEOF,
+                &&L_R_HALT
+            };
+#endif
+            Instruction* ins;
+            vmdispatch() {
+                vmcase(R_MOVE) regs[ins->a] = rk(ins->b); vmnext();
+                vmcase(R_LOADSTR) regs[ins->a] = ins->c ? literal(frame->code, ins->b):cxt.getAlloc().makeString(frame->code->strings[ins->b]); vmnext();
+                vmcase(R_GETUP) regs[ins->a] = cxt.slot(ins->b, ins->c); vmnext();
+                vmcase(R_SETUP) cxt.setSlot(ins->a, ins->b, rk(ins->c)); vmnext();
+                vmcase(R_GETGLOBAL) {
+                    Object m = cxt.global(ins->b);
+                    if (typeOf(m) == AS_REF)
+                        m = cxt.get(m.data.reference->identifier, m.data.reference->scopelevel, m.data.reference->slot);
+                    regs[ins->a] = m;
+                } vmnext();
+                vmcase(R_SETGLOBAL) {
+                    cxt.global(ins->a) = rk(ins->b);
+                    cxt.checkGC();
+                } vmnext();
+                vmcase(R_CURRENT_FUNC) regs[ins->a] = frame->func; vmnext();
+                vmcase(R_ADD) {
+                    Object& lhs = rk(ins->b);
+                    Object& rhs = rk(ins->c);
+                    if (typeOf(lhs) == AS_STRING || typeOf(rhs) == AS_STRING) {
+                        regs[ins->a] = concatenate(cxt, lhs, rhs);
+                    } else {
+                        regs[ins->a] = add(lhs, rhs);
+                    }
+                } vmnext();
+                vmcase(R_SUB) regs[ins->a] = sub(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_MUL) regs[ins->a] = mul(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_DIV) regs[ins->a] = div(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_MOD) regs[ins->a] = mod(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_POW) regs[ins->a] = pow(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_LT)  regs[ins->a] = lt(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_LTE) regs[ins->a] = lte(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_GT)  regs[ins->a] = gt(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_GTE) regs[ins->a] = gte(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_EQU) regs[ins->a] = equ(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_NEQ) regs[ins->a] = neq(rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_NEG) regs[ins->a] = neg(rk(ins->b)); vmnext();
+                vmcase(R_NOT) regs[ins->a] = makeBool(!rk(ins->b).data.boolval); vmnext();
+                vmcase(R_INCR) {
+                    Object& m = regs[ins->a];
+                    if (m.type == AS_INT) {
+                        m.data.intval += ins->b;
+                    } else if (m.type == AS_REAL) {
+                        m.data.realval += ins->b;
+                    }
+                } vmnext();
+                vmcase(R_JUMP) {
+                    if (ins->a < ip)
+                        cxt.checkGC();
+                    ip = ins->a;
+                } vmnext();
+                vmcase(R_JUMP_FALSE) if (!rk(ins->b).data.boolval) ip = ins->a; vmnext();
+                vmcase(R_JUMP_TRUE) if (rk(ins->b).data.boolval) ip = ins->a; vmnext();
+                vmcase(R_CMP_JUMP) if (!compare(ins->d, rk(ins->b), rk(ins->c))) ip = ins->a; vmnext();
+                vmcase(R_PRINT) {
+                    cout<<toString(rk(ins->a));
+                    if (ins->b) cout<<endl;
+                } vmnext();
+                vmcase(R_CLOSURE) regs[ins->a] = makeFunction(frame->code->functions[ins->b]); vmnext();
+                vmcase(R_DEF_STRUCT) defineStruct(frame->code->structs[ins->a]); vmnext();
+                vmcase(R_CALL) {
+                    frame->ip = ip;
+                    if (callFunction(regs[ins->b], &regs[ins->b+1], ins->c, ins->a, frame->code->strings[ins->d])) {
+                        frame = &frames.back();
+                        code = frame->code->code.data();
+                        consts = frame->code->constants.data();
+                        regs = cxt.getCallStack()->slots.data();
+                        ip = 0;
+                    } else {
+                        regs[ins->a] = makeNil();
+                    }
+                } vmnext();
+                vmcase(R_TAIL_CALL) {
+                    if (tailCall(regs[ins->b], &regs[ins->b+1], ins->c, frame)) {
+                        code = frame->code->code.data();
+                        consts = frame->code->constants.data();
+                        regs = cxt.getCallStack()->slots.data();
+                        ip = 0;
+                    } else {
+                        frame->ip = ip;
+                        if (callFunction(regs[ins->b], &regs[ins->b+1], ins->c, ins->a, frame->code->strings[ins->d])) {
+                            frame = &frames.back();
+                            code = frame->code->code.data();
+                            consts = frame->code->constants.data();
+                            regs = cxt.getCallStack()->slots.data();
+                            ip = 0;
+                        } else {
+                            regs[ins->a] = makeNil();
+                        }
+                    }
+                } vmnext();
+                vmcase(R_RETURN) {
+                    Object result = rk(ins->a);
+                    // collect while the callee's registers still root the result
+                    cxt.checkGC();
+                    int retReg = frame->retReg;
+                    cxt.unwindTo(frame->savedEnv);
+                    frames.pop_back();
+                    if (frames.size() <= stopDepth) {
+                        returnValue = result;
+                        return;
+                    }
+                    frame = &frames.back();
+                    code = frame->code->code.data();
+                    consts = frame->code->constants.data();
+                    regs = cxt.getCallStack()->slots.data();
+                    ip = frame->ip;
+                    regs[retReg] = result;
+                } vmnext();
+                vmcase(R_ENTER_SCOPE) {
+                    cxt.openScope(ins->a);
+                    regs = cxt.getCallStack()->slots.data();
+                } vmnext();
+                vmcase(R_EXIT_SCOPE) {
+                    cxt.closeScope();
+                    regs = cxt.getCallStack()->slots.data();
+                } vmnext();
+                vmcase(R_MAKE_LIST) {
+                    List* list = new List();
+                    for (int i = 0; i < ins->c; i++)
+                        appendList(list, regs[ins->b+i]);
+                    regs[ins->a] = cxt.getAlloc().makeList(list);
+                } vmnext();
+                vmcase(R_RANGE) regs[ins->a] = makeRangeList(cxt, rk(ins->b), rk(ins->c)); vmnext();
+                vmcase(R_INDEX) regs[ins->a] = getSubscript(cxt, rk(ins->b), rk(ins->c), frame->code->strings[ins->d], fieldCache(frame->code, ins->d)); vmnext();
+                vmcase(R_SLICE) regs[ins->a] = getSlice(cxt, rk(ins->b), rk(ins->c), rk(ins->d)); vmnext();
+                vmcase(R_STORE_INDEX) setSubscript(cxt, rk(ins->a), rk(ins->b), frame->code->strings[ins->d], rk(ins->c), fieldCache(frame->code, ins->d)); vmnext();
+                vmcase(R_SIZE)  regs[ins->a] = getSize(rk(ins->b)); vmnext();
+                vmcase(R_EMPTY) regs[ins->a] = getEmpty(rk(ins->b)); vmnext();
+                vmcase(R_FIRST) regs[ins->a] = getFirst(rk(ins->b)); vmnext();
+                vmcase(R_REST)  regs[ins->a] = getRest(cxt, rk(ins->b)); vmnext();
+                vmcase(R_APPEND) {
+                    if (rk(ins->a).type == AS_LIST) {
+                        auto held = cxt.getAlloc().writeBarrier(rk(ins->a), rk(ins->b));
+                        appendList(getList(rk(ins->a)), rk(ins->b));
+                    }
+                } vmnext();
+                vmcase(R_PUSH) {
+                    if (rk(ins->a).type == AS_LIST) {
+                        auto held = cxt.getAlloc().writeBarrier(rk(ins->a), rk(ins->b));
+                        pushList(getList(rk(ins->a)), rk(ins->b));
+                    }
+                } vmnext();
+                vmcase(R_MAP)
+                vmcase(R_FILTER)
+                vmcase(R_REDUCE)
+                vmcase(R_SORT)
+                vmcase(R_COMPREHEND) {
+                    frame->ip = ip;
+                    Object result;
+                    switch (ins->op) {
+                        case R_MAP:    result = mapList(*this, rk(ins->b), rk(ins->c)); break;
+                        case R_FILTER: result = filterList(*this, rk(ins->b), rk(ins->c)); break;
+                        case R_REDUCE: result = reduceList(*this, rk(ins->b), rk(ins->c), rk(ins->d)); break;
+                        case R_SORT:   result = sortList(*this, rk(ins->b), rk(ins->c)); break;
+                        default:       result = comprehension(*this, rk(ins->b), rk(ins->c), rk(ins->d)); break;
+                    }
+                    frame = &frames.back();
+                    regs[ins->a] = result;
+                } vmnext();
+                vmcase(R_MATCHRE) regs[ins->a] = makeBool(matchre(*getString(rk(ins->b)), *getString(rk(ins->c)))); vmnext();
+                vmcase(R_BLESS) regs[ins->a] = blessStruct(cxt, frame->code->strings[ins->b]); vmnext();
+                vmcase(R_DEREF) {
+                    Object m = rk(ins->b);
+                    if (typeOf(m) == AS_REF)
+                        m = cxt.get(m.data.reference->identifier, m.data.reference->scopelevel, m.data.reference->slot);
+                    regs[ins->a] = m;
+                } vmnext();
+                vmcase(R_TYPEOF) regs[ins->a] = typeName(cxt, rk(ins->b)); vmnext();
+                vmcase(R_HALT) {
+                    cxt.unwindTo(frame->savedEnv);
+                    frames.pop_back();
+                    return;
+                }
+                vmdefault()
+                    cout<<"Error: unknown instruction "<<ins->op<<endl;
+                    vmnext();
+            }
+        }
+    public:
+        RegisterVM(bool debug = false) {
+            loud = debug;
+            worker = false;
+        }
+        // A vm for a worker thread of a parallel map, see parallel.hpp.
+        RegisterVM(RegisterVM* parent) : cxt(&parent->cxt) {
+            loud = false;
+            worker = true;
+        }
+        // Interns func's string literals up front, workers only read them.
+        void prepareParallel(Object func) {
+            CodeObject* code = getFunction(func)->proto->code;
+            for (int i = 0; i < code->strings.size(); i++)
+                literal(code, i);
+        }
+        void exec(astnode* node) {
+            CodeObject* program = compiler.compile(node);
+            if (loud)
+                disassemble(program);
+            // top level temporaries get a window of their own, the global
+            // record's slots are the globals table
+            frames.push_back(RegisterFrame(program, -1, makeNil(), cxt.getCallStack()));
+            cxt.openScope(program->frameSize);
+            run(frames.size() - 1);
+        }
+        // Call a script function from native code and wait for its result.
+        Object invoke(Object func, Object* args, int argc) {
+            if (!callFunction(func, args, argc, -1, toString(func)))
+                return makeNil();
+            run(frames.size() - 1);
+            return returnValue;
+        }
+        Context& context() {
+            return cxt;
+        }
+};
+
+#endif
@@ -1,21 +1,81 @@
 #ifndef resolve_hpp
 #define resolve_hpp
 #include "ast.hpp"
+#include "globals.hpp"
 #include "stack.hpp"
 #include <unordered_map>
+#include <map>
+#include <vector>
 #include <iostream>
 using namespace std;
 
+// Each declaration gets a slot number in the scope that declares it, params
+// first in order. Scope owning nodes (def, lambda, block) record how many slots
+// their scope needed in scopeSize, which is what the engines size frames by:
+// a local is then found at (depth, slot) without hashing its name. Names
+// which aren't declared in any enclosing scope are globals, depth -1, and
+// their slot is the index globalTable() gave them.
+//
+// A name declared in an enclosing function is one of the current function's
+// upvalues, depth -2, slot its index in the closure's upvalues. The def or
+// lambda node lists what to capture in child[2], one ID node per upvalue
+// giving where the variable is found at the point the closure is made.
+// Every use of a variable some closure captures is marked captured: the
+// variable lives in a cell from then on.
+//
+// A block whose declarations can safely outlive it gets no record of its
+// own: its names stay private to it but their slots are numbered on from
+// the enclosing record's, and it doesn't count towards depth. Such blocks
+// are marked with a scopeSize of NO_SCOPE.
+struct ScopeEntry {
+    bool defined;
+    bool captured;
+    int slot;
+    vector<astnode*> uses;
+    ScopeEntry(bool def = false, int s = -1) : defined(def), captured(false), slot(s) { }
+};
+
+// The function (def or lambda) being resolved: which of its calls are in
+// tail position, marked once it's closed, and the upvalues it needs, keyed
+// by the (scope, slot) they were declared at.
+struct FunctionEntry {
+    astnode* node;
+    int scopeBase;
+    vector<astnode*> tailCalls;
+    map<pair<int,int>, int> upvalues;
+    vector<astnode*> captures;
+    FunctionEntry(astnode* n = nullptr, int base = 0) : node(n), scopeBase(base) { }
+};
+
+typedef unordered_map<string, ScopeEntry> ScopeMap;
+
+// frame is the index of the scope whose record holds this one's slots, its
+// own for anything but a folded block.
+struct Scope {
+    ScopeMap names;
+    int frame;
+    int size;
+    Scope(int f = 0) : frame(f), size(0) { }
+};
+
 class ScopeLevelResolver {
     private:
         bool loud;
-        typedef unordered_map<string, bool> ScopeMap;
-        IndexedStack<ScopeMap> scopes;
+        IndexedStack<Scope> scopes;
+        vector<FunctionEntry> functions;
         unordered_map<astnode*, int> depthmap;
         void declareVarName(string id);
         void defineVarName(string id);
-        void openScope();
-        void closeScope();
+        void declareParam(astnode* node);
+        void openScope(bool folded = false);
+        void closeScope(astnode* owner);
+        enum { DECLARES = 1, UNINITIALIZED = 2, CLOSURES = 4 };
+        bool canFold(astnode* block);
+        void scanBlock(astnode* node, bool own, int& found);
+        int frameDistance(int from, int to);
+        void openFunction(astnode* node);
+        void closeFunction();
+        int upvalueIndex(int func, int scope, const string& id);
         void resolveBlockStatement(astnode* node);
         void resolveLetStatement(astnode* node);
         void resolveDefStatement(astnode* node);
@@ -34,6 +94,7 @@ ScopeLevelResolver::ScopeLevelResolver(bool debug) {
 
 astnode* ScopeLevelResolver::resolveScope(astnode* node) {
     scopes.clear(); 
+    functions.clear();
     resolve(node);
     return node;
 }
@@ -70,13 +131,14 @@ void ScopeLevelResolver::resolveExpressionScope(astnode* node) {
             resolve(node->child[0]); 
         } break;
         case LAMBDA_EXPR: {
+            openFunction(node);
             openScope();
             for (auto it = node->child[0]; it != nullptr; it = it->next) {
-                declareVarName(it->token.strval);
-                defineVarName(it->token.strval);
+                declareParam(it);
             }
             resolve(node->child[1]);
-            closeScope();
+            closeScope(node);
+            closeFunction();
             return;
         } break;
         default:
@@ -104,6 +166,8 @@ void ScopeLevelResolver::resolveStatementScope(astnode* node) {
             resolve(node->child[0]);
             break;
         case RETURN_STMT: 
+            if (!functions.empty() && isExprType(node->child[0], FUNC_EXPR))
+                functions.back().tailCalls.push_back(node->child[0]);
             resolve(node->child[0]);
             break;
         case PRINT_STMT:
@@ -115,9 +179,54 @@ void ScopeLevelResolver::resolveStatementScope(astnode* node) {
 }
 
 void ScopeLevelResolver::resolveBlockStatement(astnode* node) {
-    openScope();
+    openScope(canFold(node));
     resolve(node->child[0]);
-    closeScope();
+    closeScope(node);
+}
+
+// What a block's statements (own) and anything nested in them do.
+void ScopeLevelResolver::scanBlock(astnode* node, bool own, int& found) {
+    for (; node != nullptr; node = node->next) {
+        if (isStmtType(node, FUNC_DEF_STMT)) {
+            found |= CLOSURES | (own ? DECLARES:0);
+            continue;
+        }
+        if (isExprType(node, LAMBDA_EXPR)) {
+            found |= CLOSURES;
+            continue;
+        }
+        if (own && isStmtType(node, LET_STMT)) {
+            found |= DECLARES;
+            if (!isExprType(node->child[0], ASSIGN_EXPR))
+                found |= UNINITIALIZED;
+        }
+        for (int i = 0; i < MAX_CHILD; i++)
+            scanBlock(node->child[i], own && !isStmtType(node, BLOCK_STMT), found);
+    }
+}
+
+// A record of its own starts a block's variables out nil and, if a closure
+// captures them, in fresh cells on every entry. A block which declares
+// nothing needs neither, nor does one whose variables are all initialized
+// and which makes no closures.
+bool ScopeLevelResolver::canFold(astnode* block) {
+    if (scopes.empty())
+        return false;
+    int found = 0;
+    scanBlock(block->child[0], true, found);
+    if (!(found & DECLARES))
+        return true;
+    return !(found & (UNINITIALIZED | CLOSURES));
+}
+
+// How many records out from scopes[from] the one holding scopes[to] is.
+int ScopeLevelResolver::frameDistance(int from, int to) {
+    int distance = 0;
+    for (int i = from; i > to; i--) {
+        if (scopes.get(i).frame == i)
+            distance++;
+    }
+    return distance;
 }
 
 void ScopeLevelResolver::resolveLetStatement(astnode* node) {
@@ -135,50 +244,140 @@ void ScopeLevelResolver::resolveLetStatement(astnode* node) {
 void ScopeLevelResolver::resolveDefStatement(astnode* node) {
     declareVarName(node->token.strval);
     defineVarName(node->token.strval);
+    if (!scopes.empty()) {
+        ScopeEntry& entry = scopes.top().names[node->token.strval];
+        node->token.depth = 0;
+        node->token.slot = entry.slot;
+        entry.uses.push_back(node);
+    } else {
+        node->token.depth = GLOBAL_SCOPE_DEPTH;
+        node->token.slot = globalTable().indexOf(node->token.strval);
+    }
+    openFunction(node);
     openScope();
     for (auto it = node->child[0]; it != nullptr; it = it->next) {
         if (isExprType(it, REF_EXPR)) {
-            declareVarName(it->child[0]->token.strval);
-            defineVarName(it->child[0]->token.strval);
+            declareParam(it->child[0]);
         } else {
-            declareVarName(it->token.strval);
-            defineVarName(it->token.strval);
+            declareParam(it);
         }
     }
     resolve(node->child[1]);
-    closeScope();
+    closeScope(node);
+    closeFunction();
+}
+
+void ScopeLevelResolver::declareParam(astnode* node) {
+    declareVarName(node->token.strval);
+    defineVarName(node->token.strval);
+    ScopeEntry& entry = scopes.top().names[node->token.strval];
+    node->token.depth = 0;
+    node->token.slot = entry.slot;
+    entry.uses.push_back(node);
 }
 
 void ScopeLevelResolver::resolveVariableDepth(astnode* node, string id) {
+    if (id == "_rc") {
+        node->token.depth = CURRENT_FUNCTION_DEPTH;
+        node->token.slot = 0;
+        return;
+    }
     for (int i = scopes.size() - 1; i >= 0; i--) {
-        if (scopes.get(i).find(id) != scopes.get(i).end()) {
-            node->token.depth = scopes.size() - 1 - i;
+        auto it = scopes.get(i).names.find(id);
+        if (it != scopes.get(i).names.end()) {
+            if (!functions.empty() && i < functions.back().scopeBase) {
+                node->token.depth = UPVALUE_DEPTH;
+                node->token.slot = upvalueIndex(functions.size() - 1, i, id);
+                if (loud)
+                    cout<<"Resolve: "<<id<<" as upvalue "<<node->token.slot<<endl;
+                return;
+            }
+            node->token.depth = frameDistance(scopes.size() - 1, i);
+            node->token.slot = it->second.slot;
+            it->second.uses.push_back(node);
             if (loud)
-                cout<<"Resolve: "<<id<<" at nest depth "<<node->token.depth<<endl;
+                cout<<"Resolve: "<<id<<" at nest depth "<<node->token.depth<<", slot "<<node->token.slot<<endl;
             return;
         }
     }
-    node->token.depth = -1;
+    node->token.depth = GLOBAL_SCOPE_DEPTH;
+    node->token.slot = globalTable().indexOf(id);
+    if (loud)
+        cout<<"Resolve: "<<id<<" as global "<<node->token.slot<<endl;
 }
 
-void ScopeLevelResolver::openScope() {
-    scopes.push(ScopeMap());
+void ScopeLevelResolver::openScope(bool folded) {
+    int frame = scopes.size();
+    if (folded)
+        frame = scopes.top().frame;
+    scopes.push(Scope(frame));
 }
 
-void ScopeLevelResolver::closeScope() {
+void ScopeLevelResolver::closeScope(astnode* owner) {
+    Scope& scope = scopes.top();
+    owner->scopeSize = scope.frame == scopes.size() - 1 ? scope.size:NO_SCOPE;
+    for (auto & entry : scope.names) {
+        if (entry.second.captured) {
+            for (astnode* use : entry.second.uses)
+                use->token.captured = true;
+        }
+    }
     scopes.pop();
 }
 
+// The index of the variable id, declared in scopes[scope], among the
+// upvalues of functions[func]. The capture describing where to find it when
+// the closure is made is either a local of the enclosing function, or one
+// of that function's own upvalues.
+int ScopeLevelResolver::upvalueIndex(int func, int scope, const string& id) {
+    FunctionEntry& entry = functions[func];
+    ScopeEntry& var = scopes.get(scope).names[id];
+    auto key = make_pair(scope, var.slot);
+    auto it = entry.upvalues.find(key);
+    if (it != entry.upvalues.end())
+        return it->second;
+    astnode* capture = new astnode(EXPR_NODE, Token(TK_ID, id));
+    capture->type.expr = ID_EXPR;
+    if (func > 0 && scope < functions[func-1].scopeBase) {
+        capture->token.depth = UPVALUE_DEPTH;
+        capture->token.slot = upvalueIndex(func - 1, scope, id);
+    } else {
+        capture->token.depth = frameDistance(entry.scopeBase - 1, scope);
+        capture->token.slot = var.slot;
+        var.captured = true;
+        var.uses.push_back(capture);
+    }
+    int index = entry.captures.size();
+    entry.upvalues[key] = index;
+    entry.captures.push_back(capture);
+    return index;
+}
+
+void ScopeLevelResolver::openFunction(astnode* node) {
+    functions.push_back(FunctionEntry(node, scopes.size()));
+}
+
+void ScopeLevelResolver::closeFunction() {
+    FunctionEntry& func = functions.back();
+    for (astnode* call : func.tailCalls)
+        call->tail = TAIL_CALL;
+    for (int i = 0; i + 1 < func.captures.size(); i++)
+        func.captures[i]->next = func.captures[i+1];
+    func.node->child[2] = func.captures.empty() ? nullptr:func.captures[0];
+    functions.pop_back();
+}
+
 void ScopeLevelResolver::declareVarName(string id) {
     if (scopes.empty())
         return;
-    if (scopes.top().find(id) != scopes.top().end()) {
+    if (scopes.top().names.find(id) != scopes.top().names.end()) {
         cout<<"That name already exists in this scope."<<endl;
         return;
     }
     if (loud)
         cout<<"Declare: "<<id<<" (scope: "<<scopes.size()<<")"<<endl;
-    scopes.top()[id] = false;
+    int slot = scopes.get(scopes.top().frame).size++;
+    scopes.top().names[id] = ScopeEntry(false, slot);
 }
 
 void ScopeLevelResolver::defineVarName(string id) {
@@ -187,7 +386,7 @@ void ScopeLevelResolver::defineVarName(string id) {
     
     if (loud)
         cout<<"Define: "<<id<<" (scope: "<<scopes.size()<<")"<<endl;
-    scopes.top()[id] = true;
+    scopes.top().names[id].defined = true;
 }
 
 #endif
\ No newline at end of file
@@ -1,17 +1,27 @@
 #ifndef scope_hpp
 #define scope_hpp
 #include <unordered_map>
+#include <vector>
 #include "object.hpp"
 #include "allocator.hpp"
 using namespace std;
 
 typedef unordered_map<string, Object> Environment;
 
+// A call's record has no access link: anything the body uses from outside
+// the function is global or one of function's upvalues. Block scopes link
+// to the record they're opened in and share its function.
 struct ActivationRecord {
     Environment bindings;
+    vector<Object> slots;
     ActivationRecord* controlLink;
     ActivationRecord* accessLink;
-    ActivationRecord(ActivationRecord* defining = nullptr, ActivationRecord* calling = nullptr) : accessLink(defining), controlLink(calling) { }
+    Object function;
+    ActivationRecord(ActivationRecord* defining = nullptr, ActivationRecord* calling = nullptr) : accessLink(defining), controlLink(calling) {
+        if (defining != nullptr)
+            function = defining->function;
+    }
+    ActivationRecord(Object func, ActivationRecord* calling) : controlLink(calling), accessLink(nullptr), function(func) { }
 };
 
 
@@ -0,0 +1,397 @@
+#ifndef sort_hpp
+#define sort_hpp
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+#include "object.hpp"
+#include "parallel.hpp"
+using namespace std;
+
+/*
+    sort() without a comparator. The elements are looked at once to pick
+    an algorithm for what the list holds:
+
+        all integers                 LSD radix sort on the 32 bit value
+        all numbers (int/real/bool)  pdqsort on the value as a double
+        all strings                  pdqsort comparing the strings directly
+        anything else                stable merge sort, each element's
+                                     string form computed once
+
+    The order is the one gt() gives, only without building a string per
+    comparison. Lists of at least the parallel threshold (-p) are cut into
+    one run per pool thread, the runs sorted on the pool with the same
+    algorithm and then merged pairwise.
+
+    sort() with a comparator stays on sortListWith()'s merge sort, as the
+    comparator is script code.
+*/
+
+const int PDQ_INSERTION_SORT = 24;
+const int PDQ_NINTHER = 128;
+const int PDQ_PARTIAL_INSERTION_LIMIT = 8;
+
+template <class T, class Less>
+void insertionSort(T* begin, T* end, Less& less) {
+    if (begin == end)
+        return;
+    for (T* cur = begin + 1; cur != end; cur++) {
+        T* sift = cur;
+        if (less(*sift, *(sift - 1))) {
+            T tmp = *sift;
+            do {
+                *sift = *(sift - 1);
+                sift--;
+            } while (sift != begin && less(tmp, *(sift - 1)));
+            *sift = tmp;
+        }
+    }
+}
+
+// As insertionSort, but *(begin - 1) is known to be no greater than
+// anything in [begin, end), so it stops the sift without a bounds check.
+template <class T, class Less>
+void unguardedInsertionSort(T* begin, T* end, Less& less) {
+    if (begin == end)
+        return;
+    for (T* cur = begin + 1; cur != end; cur++) {
+        T* sift = cur;
+        if (less(*sift, *(sift - 1))) {
+            T tmp = *sift;
+            do {
+                *sift = *(sift - 1);
+                sift--;
+            } while (less(tmp, *(sift - 1)));
+            *sift = tmp;
+        }
+    }
+}
+
+// Insertion sort that gives up once it has moved more than a few elements,
+// telling whether it got [begin, end) sorted.
+template <class T, class Less>
+bool partialInsertionSort(T* begin, T* end, Less& less) {
+    if (begin == end)
+        return true;
+    int moved = 0;
+    for (T* cur = begin + 1; cur != end; cur++) {
+        T* sift = cur;
+        if (less(*sift, *(sift - 1))) {
+            T tmp = *sift;
+            do {
+                *sift = *(sift - 1);
+                sift--;
+            } while (sift != begin && less(tmp, *(sift - 1)));
+            *sift = tmp;
+            moved += cur - sift;
+        }
+        if (moved > PDQ_PARTIAL_INSERTION_LIMIT)
+            return false;
+    }
+    return true;
+}
+
+template <class T, class Less>
+void sort2(T* a, T* b, Less& less) {
+    if (less(*b, *a))
+        swap(*a, *b);
+}
+
+template <class T, class Less>
+void sort3(T* a, T* b, T* c, Less& less) {
+    sort2(a, b, less);
+    sort2(b, c, less);
+    sort2(a, b, less);
+}
+
+// Partitions around *begin into [< pivot] pivot [>= pivot], returning where
+// the pivot ended up and whether nothing had to be swapped.
+template <class T, class Less>
+T* partitionRight(T* begin, T* end, Less& less, bool& wasPartitioned) {
+    T pivot = *begin;
+    T* first = begin;
+    T* last = end;
+    while (less(*++first, pivot));
+    if (first - 1 == begin) {
+        while (first < last && !less(*--last, pivot));
+    } else {
+        while (!less(*--last, pivot));
+    }
+    wasPartitioned = first >= last;
+    while (first < last) {
+        swap(*first, *last);
+        while (less(*++first, pivot));
+        while (!less(*--last, pivot));
+    }
+    T* pivotPos = first - 1;
+    *begin = *pivotPos;
+    *pivotPos = pivot;
+    return pivotPos;
+}
+
+// Partitions around *begin into [<= pivot] pivot [> pivot]. Used when the
+// pivot equals the element before the range, so everything equal to it is
+// put in place at once and many duplicates don't cost quadratic time.
+template <class T, class Less>
+T* partitionLeft(T* begin, T* end, Less& less) {
+    T pivot = *begin;
+    T* first = begin;
+    T* last = end;
+    while (less(pivot, *--last));
+    if (last + 1 == end) {
+        while (first < last && !less(pivot, *++first));
+    } else {
+        while (!less(pivot, *++first));
+    }
+    while (first < last) {
+        swap(*first, *last);
+        while (less(pivot, *--last));
+        while (!less(pivot, *++first));
+    }
+    T* pivotPos = last;
+    *begin = *pivotPos;
+    *pivotPos = pivot;
+    return pivotPos;
+}
+
+// Breaks up whatever pattern made the last partition lopsided by swapping
+// a few elements at a quarter of the way in from either end of [begin, end).
+template <class T>
+void shuffleEnds(T* begin, T* end) {
+    int size = end - begin;
+    if (size < PDQ_INSERTION_SORT)
+        return;
+    int q = size / 4;
+    swap(begin[0], begin[q]);
+    swap(end[-1], end[-q]);
+    if (size > PDQ_NINTHER) {
+        swap(begin[1], begin[q + 1]);
+        swap(begin[2], begin[q + 2]);
+        swap(end[-2], end[-(q + 1)]);
+        swap(end[-3], end[-(q + 2)]);
+    }
+}
+
+template <class T, class Less>
+void pdqsortLoop(T* begin, T* end, Less& less, int badAllowed, bool leftmost) {
+    while (true) {
+        int size = end - begin;
+        if (size < PDQ_INSERTION_SORT) {
+            if (leftmost) insertionSort(begin, end, less);
+            else unguardedInsertionSort(begin, end, less);
+            return;
+        }
+        int half = size / 2;
+        if (size > PDQ_NINTHER) {
+            sort3(begin, begin + half, end - 1, less);
+            sort3(begin + 1, begin + (half - 1), end - 2, less);
+            sort3(begin + 2, begin + (half + 1), end - 3, less);
+            sort3(begin + (half - 1), begin + half, begin + (half + 1), less);
+            swap(*begin, *(begin + half));
+        } else {
+            sort3(begin + half, begin, end - 1, less);
+        }
+        if (!leftmost && !less(*(begin - 1), *begin)) {
+            begin = partitionLeft(begin, end, less) + 1;
+            continue;
+        }
+        bool wasPartitioned;
+        T* pivotPos = partitionRight(begin, end, less, wasPartitioned);
+        int leftSize = pivotPos - begin;
+        int rightSize = end - (pivotPos + 1);
+        if (leftSize < size / 8 || rightSize < size / 8) {
+            if (--badAllowed == 0) {
+                make_heap(begin, end, less);
+                sort_heap(begin, end, less);
+                return;
+            }
+            shuffleEnds(begin, pivotPos);
+            shuffleEnds(pivotPos + 1, end);
+        } else if (wasPartitioned && partialInsertionSort(begin, pivotPos, less)
+                                   && partialInsertionSort(pivotPos + 1, end, less)) {
+            return;
+        }
+        pdqsortLoop(begin, pivotPos, less, badAllowed, leftmost);
+        begin = pivotPos + 1;
+        leftmost = false;
+    }
+}
+
+// Pattern defeating quicksort: quicksort on a median of three (ninther for
+// large ranges) that notices already sorted and many-duplicate input and
+// falls back to heapsort after too many bad pivots. less has to be a
+// strict weak order.
+template <class T, class Less>
+void pdqSort(T* begin, T* end, Less less) {
+    int size = end - begin;
+    if (size < 2)
+        return;
+    int log2 = 0;
+    while (size >>= 1)
+        log2++;
+    pdqsortLoop(begin, end, less, log2, true);
+}
+
+// Sorts integers in four passes of a byte each, low byte first. The counts
+// for all four bytes are taken in one read, and a byte that is the same in
+// every element (the high ones, for small values) is skipped.
+void radixSortInts(Object* begin, Object* end) {
+    int n = end - begin;
+    if (n < 2)
+        return;
+    vector<int> counts(4 * 256);
+    for (Object* it = begin; it != end; it++) {
+        uint32_t key = (uint32_t)it->data.intval ^ 0x80000000u;
+        counts[key & 0xff]++;
+        counts[256 + (key >> 8 & 0xff)]++;
+        counts[512 + (key >> 16 & 0xff)]++;
+        counts[768 + (key >> 24)]++;
+    }
+    vector<Object> buffer(n);
+    Object* from = begin;
+    Object* to = buffer.data();
+    uint32_t firstKey = (uint32_t)begin->data.intval ^ 0x80000000u;
+    for (int pass = 0; pass < 4; pass++) {
+        int shift = pass * 8;
+        int* count = &counts[pass * 256];
+        if (count[firstKey >> shift & 0xff] == n)
+            continue;
+        int sum = 0;
+        for (int b = 0; b < 256; b++) {
+            int c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (Object* it = from; it != from + n; it++)
+            to[count[((uint32_t)it->data.intval ^ 0x80000000u) >> shift & 0xff]++] = *it;
+        swap(from, to);
+    }
+    if (from != begin)
+        copy(from, from + n, begin);
+}
+
+// A double's bits rearranged so that they order as unsigned integers the
+// way the doubles do, giving NaNs a place instead of breaking the sort.
+uint64_t orderedBits(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof bits);
+    return bits & 0x8000000000000000ull ? ~bits:bits | 0x8000000000000000ull;
+}
+
+struct NumberLess {
+    bool operator()(const Object& a, const Object& b) const {
+        return orderedBits(getPrimitive(a)) < orderedBits(getPrimitive(b));
+    }
+};
+
+struct StringLess {
+    bool operator()(const Object& a, const Object& b) const {
+        return *a.data.gcobj->strval < *b.data.gcobj->strval;
+    }
+};
+
+// Element of a mixed list along with what gt() would compare it by.
+struct MixedKey {
+    Object item;
+    bool ordinal;
+    double number;
+    const string* text;
+};
+
+// The same test as gt(b, a), on precomputed keys. For mixed types this
+// isn't a strict weak order, which merge sort, unlike pdqsort, copes with.
+struct MixedBefore {
+    bool operator()(const MixedKey& a, const MixedKey& b) const {
+        if (a.ordinal && b.ordinal)
+            return b.number > a.number;
+        return *b.text > *a.text;
+    }
+};
+
+void sortMixed(vector<Object>& v) {
+    vector<string> texts(v.size());
+    vector<MixedKey> keys(v.size());
+    for (int i = 0; i < v.size(); i++) {
+        texts[i] = toString(v[i]);
+        keys[i] = { v[i], compareOrdinal(v[i]), getPrimitive(v[i]), &texts[i] };
+    }
+    vector<MixedKey> tmp(keys.size());
+    MixedBefore before;
+    mergeSortObjects(keys, tmp, 0, keys.size(), before);
+    for (int i = 0; i < v.size(); i++)
+        v[i] = keys[i].item;
+}
+
+// Sorts one run per pool thread with sortRun(begin, end), then merges the
+// runs pairwise, a round of merges at a time.
+template <class Less, class SortRun>
+void parallelMergeSort(vector<Object>& v, Less less, SortRun sortRun) {
+    int n = v.size();
+    int runs = min(threadPool().size(), n);
+    vector<int> bounds(runs + 1);
+    for (int r = 0; r <= runs; r++)
+        bounds[r] = (long long)n * r / runs;
+    Object* data = v.data();
+    vector<function<void()>> tasks;
+    for (int r = 0; r < runs; r++)
+        tasks.push_back([&, r]() { sortRun(data + bounds[r], data + bounds[r + 1]); });
+    threadPool().run(tasks);
+    vector<Object> merged(n);
+    for (int width = 1; width < runs; width *= 2) {
+        tasks.clear();
+        for (int r = 0; r + width < runs; r += 2 * width) {
+            int lo = bounds[r], mid = bounds[r + width], hi = bounds[min(r + 2 * width, runs)];
+            tasks.push_back([&, lo, mid, hi]() {
+                merge(data + lo, data + mid, data + mid, data + hi, merged.data() + lo, less);
+                copy(merged.data() + lo, merged.data() + hi, data + lo);
+            });
+        }
+        threadPool().run(tasks);
+    }
+}
+
+bool sortsInParallel(int n) {
+    ParallelConfig& config = parallelConfig();
+    return config.threshold > 0 && config.threads >= 2 && n >= config.threshold;
+}
+
+template <class Less, class SortRun>
+void sortRuns(vector<Object>& v, Less less, SortRun sortRun) {
+    if (sortsInParallel(v.size()))
+        parallelMergeSort(v, less, sortRun);
+    else
+        sortRun(v.data(), v.data() + v.size());
+}
+
+void sortObjects(vector<Object>& v) {
+    bool ints = true, numbers = true, strings = true;
+    for (Object& m : v) {
+        ints = ints && m.type == AS_INT;
+        numbers = numbers && compareOrdinal(m);
+        strings = strings && m.type == AS_STRING;
+    }
+    if (ints) {
+        sortRuns(v, NumberLess(), [](Object* begin, Object* end) { radixSortInts(begin, end); });
+    } else if (numbers) {
+        sortRuns(v, NumberLess(), [](Object* begin, Object* end) { pdqSort(begin, end, NumberLess()); });
+    } else if (strings) {
+        sortRuns(v, StringLess(), [](Object* begin, Object* end) { pdqSort(begin, end, StringLess()); });
+    } else {
+        sortMixed(v);
+    }
+}
+
+// Sorts list in place in ascending order.
+void sortListNatural(List* list) {
+    int n = listSize(list);
+    vector<Object> v(n);
+    for (int i = 0; i < n; i++)
+        v[i] = listGet(list, i);
+    sortObjects(v);
+    ownList(list);
+    for (int i = 0; i < n; i++)
+        listAt(list, i) = v[i];
+}
+
+#endif
@@ -0,0 +1,455 @@
+#ifndef stackvm_hpp
+#define stackvm_hpp
+#include <iostream>
+#include <vector>
+#include "allocator.hpp"
+#include "ast.hpp"
+#include "builtins.hpp"
+#include "bytecode.hpp"
+#include "compiler.hpp"
+#include "context.hpp"
+#include "object.hpp"
+#include "regex/patternmatcher.hpp"
+using namespace std;
+
+struct CallFrame {
+    CodeObject* code;
+    int ip;
+    int base;
+    Object func;
+    ActivationRecord* savedEnv;
+    CallFrame(CodeObject* c = nullptr, int b = 0, Object f = Object(), ActivationRecord* env = nullptr) : code(c), ip(0), base(b), func(f), savedEnv(env) { }
+};
+
+class StackVM {
+    private:
+        bool loud;
+        bool worker;
+        Context cxt;
+        ByteCodeCompiler compiler;
+        vector<CallFrame> frames;
+        void push(Object info) {
+            cxt.getOperandStack().push(info);
+        }
+        Object pop() {
+            if (cxt.getOperandStack().empty()) {
+                cout<<"Error: Stack Underflow."<<endl;
+                return cxt.nil();
+            }
+            return cxt.getOperandStack().pop();
+        }
+        Object& peek(int spaces) {
+            return cxt.getOperandStack().get(cxt.getOperandStack().size()-1-spaces);
+        }
+        void popTo(int base) {
+            while (cxt.getOperandStack().size() > base)
+                cxt.getOperandStack().pop();
+        }
+        Object& variable(int index, int depth) {
+            if (depth == GLOBAL_SCOPE_DEPTH)
+                return cxt.global(index);
+            return cxt.slot(depth, index);
+        }
+        Object load(int index, int depth) {
+            Object m = variable(index, depth);
+            if (typeOf(m) == AS_REF)
+                m = cxt.get(m.data.reference->identifier, m.data.reference->scopelevel, m.data.reference->slot);
+            return m;
+        }
+        void store(int index, int depth, Object value) {
+            if (depth == GLOBAL_SCOPE_DEPTH)
+                cxt.global(index) = value;
+            else
+                cxt.setSlot(depth, index, value);
+            cxt.checkGC();
+        }
+        bool compare(int relop, Object& lhs, Object& rhs) {
+            switch (relop) {
+                case OP_LT:  return lt(lhs, rhs).data.boolval;
+                case OP_LTE: return lte(lhs, rhs).data.boolval;
+                case OP_GT:  return gt(lhs, rhs).data.boolval;
+                case OP_GTE: return gte(lhs, rhs).data.boolval;
+                case OP_EQU: return equ(lhs, rhs).data.boolval;
+                case OP_NEQ: return neq(lhs, rhs).data.boolval;
+                default:
+                    break;
+            }
+            return false;
+        }
+        // Shared string literals (see markSharedLiterals) are interned once
+        // per code object; one that was adopted by a mutation gets swapped
+        // for a fresh interned copy.
+        Object& literal(CodeObject* code, int i) {
+            if (code->literals.size() < code->strings.size())
+                code->literals.resize(code->strings.size(), makeNil());
+            Object& k = code->literals[i];
+            if (k.type != AS_STRING || !k.data.gcobj->immortal)
+                k = cxt.getAlloc().internString(code->strings[i]);
+            return k;
+        }
+        // Workers skip the field caches rather than race on them.
+        FieldCache* fieldCache(CodeObject* code, int i) {
+            return worker ? nullptr:code->fieldCache(i);
+        }
+        Object makeFunction(CodeObject* proto) {
+            Function* func = new Function(proto->proto);
+            for (auto & up : proto->captures)
+                func->upvalues.push_back(cxt.capture(up.first, up.second));
+            return cxt.getAlloc().makeFunction(func);
+        }
+        void defineStruct(StructDef& def) {
+            StructType* st = new StructType(def.typeName);
+            for (string& field : def.fields) {
+                st->addField(field);
+            }
+            cxt.addStructType(st);
+        }
+        // Expects the function object followed by argc arguments on the operand stack.
+        // On success a frame for the callee is pushed and the callers ip has to be saved
+        // by whoever is running the dispatch loop.
+        bool callFunction(int argc, CallSite* site) {
+            int base = cxt.getOperandStack().size() - argc - 1;
+            Object m = cxt.getOperandStack().get(base);
+            if (m.type != AS_FUNC || getFunction(m) == nullptr || getFunction(m)->proto->code == nullptr) {
+                cout<<"Couldn't find function named: "<<(site ? site->callee:toString(m))<<endl;
+                popTo(base);
+                push(makeNil());
+                return false;
+            }
+            Function* func = getFunction(m);
+            CodeObject* proto = func->proto->code;
+            ActivationRecord* env = cxt.callRecord(m, cxt.getCallStack(), proto->frameSize);
+            for (int i = 0; i < argc && i < proto->params.size(); i++) {
+                if (proto->refParams[i] && site != nullptr && site->argRefs[i].type == AS_REF) {
+                    env->slots[i] = site->argRefs[i];
+                } else {
+                    env->slots[i] = cxt.getOperandStack().get(base + 1 + i);
+                }
+            }
+            frames.push_back(CallFrame(proto, base, m, cxt.getCallStack()));
+            cxt.openScope(env);
+            return true;
+        }
+        // `return f(...)`: expects the same operand stack as callFunction,
+        // but instead of pushing a frame turns the current one into the
+        // callee's, so tail recursion runs in constant frames, the callee
+        // taking over the caller's recycled record. Leaves the stack alone
+        // and returns false when it has to be an ordinary call: a callee
+        // which isn't compiled script code, or one with ref params.
+        bool tailCall(int argc, CallFrame* frame) {
+            int top = cxt.getOperandStack().size() - argc - 1;
+            Object m = cxt.getOperandStack().get(top);
+            if (m.type != AS_FUNC || getFunction(m) == nullptr || getFunction(m)->proto->code == nullptr)
+                return false;
+            Function* func = getFunction(m);
+            CodeObject* proto = func->proto->code;
+            for (bool ref : proto->refParams) {
+                if (ref) return false;
+            }
+            cxt.unwindTo(frame->savedEnv);
+            ActivationRecord* env = cxt.callRecord(m, frame->savedEnv, proto->frameSize);
+            for (int i = 0; i <= argc; i++) {
+                Object arg = cxt.getOperandStack().get(top + i);
+                if (i > 0 && i <= proto->params.size())
+                    env->slots[i-1] = arg;
+                cxt.getOperandStack().get(frame->base + i) = arg;
+            }
+            popTo(frame->base + argc + 1);
+            frame->code = proto;
+            frame->func = m;
+            cxt.openScope(env);
+            return true;
+        }
+        void run(int stopDepth) {
+            CallFrame* frame = &frames.back();
+            Instruction* code = frame->code->code.data();
+            int ip = frame->ip;
+#ifdef OWL_THREADED_DISPATCH
+            static void* dispatchTable[] = {
+                &&L_OP_CONST, &&L_OP_STRING, &&L_OP_LOAD, &&L_OP_STORE, &&L_OP_CURRENT_FUNC, &&L_OP_POP,
+                &&L_OP_DUP, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD,
+                &&L_OP_POW, &&L_OP_NEG, &&L_OP_NOT, &&L_OP_INCR, &&L_OP_LT, &&L_OP_LTE,
+                &&L_OP_GT, &&L_OP_GTE, &&L_OP_EQU, &&L_OP_NEQ, &&L_OP_JUMP, &&L_OP_JUMP_FALSE,
+                &&L_OP_JUMP_FALSE_KEEP, &&L_OP_JUMP_TRUE_KEEP, &&L_OP_PRINT, &&L_OP_DEF_FUNC, &&L_OP_LAMBDA, &&L_OP_DEF_STRUCT,
+                &&L_OP_CALL, &&L_OP_TAIL_CALL, &&L_OP_RETURN, &&L_OP_ENTER_SCOPE, &&L_OP_EXIT_SCOPE, &&L_OP_MAKE_LIST,
+                &&L_OP_RANGE, &&L_OP_INDEX, &&L_OP_STORE_INDEX, &&L_OP_SLICE, &&L_OP_SIZE, &&L_OP_EMPTY,
+                &&L_OP_APPEND, &&L_OP_PUSH, &&L_OP_FIRST, &&L_OP_REST, &&L_OP_MAP, &&L_OP_FILTER,
+                &&L_OP_REDUCE, &&L_OP_SORT, &&L_OP_COMPREHEND, &&L_OP_MATCHRE, &&L_OP_BLESS, &&L_OP_DEREF,
+                &&L_OP_TYPEOF, &&L_OP_INCR_VAR, &&L_OP_ADD_VAR_K, &&L_OP_CMP_JUMP, &&L_OP_CMP_K_JUMP, &&L_OP_LOAD_INDEXED,
+                &&L_OP_HALT
+            };
+#endif
+            Instruction* ins;
+            vmdispatch() {
+                vmcase(OP_CONST) push(frame->code->constants[ins->a]); vmnext();
+                vmcase(OP_STRING) push(ins->b ? literal(frame->code, ins->a):cxt.getAlloc().makeString(frame->code->strings[ins->a])); vmnext();
+                vmcase(OP_LOAD) push(load(ins->a, ins->b)); vmnext();
+                vmcase(OP_STORE) store(ins->a, ins->b, pop()); vmnext();
+                vmcase(OP_CURRENT_FUNC) push(frame->func); vmnext();
+                vmcase(OP_POP) pop(); vmnext();
+                vmcase(OP_DUP) push(peek(0)); vmnext();
+                vmcase(OP_ADD) {
+                    if (typeOf(peek(0)) == AS_STRING || typeOf(peek(1)) == AS_STRING) {
+                        Object result = concatenate(cxt, peek(1), peek(0));
+                        pop(); pop();
+                        push(result);
+                    } else {
+                        Object rhs = pop();
+                        Object lhs = pop();
+                        push(add(lhs, rhs));
+                    }
+                } vmnext();
+                vmcase(OP_SUB) { Object rhs = pop(); Object lhs = pop(); push(sub(lhs, rhs)); } vmnext();
+                vmcase(OP_MUL) { Object rhs = pop(); Object lhs = pop(); push(mul(lhs, rhs)); } vmnext();
+                vmcase(OP_DIV) { Object rhs = pop(); Object lhs = pop(); push(div(lhs, rhs)); } vmnext();
+                vmcase(OP_MOD) { Object rhs = pop(); Object lhs = pop(); push(mod(lhs, rhs)); } vmnext();
+                vmcase(OP_POW) { Object rhs = pop(); Object lhs = pop(); push(pow(lhs, rhs)); } vmnext();
+                vmcase(OP_LT)  { Object rhs = pop(); Object lhs = pop(); push(lt(lhs, rhs)); } vmnext();
+                vmcase(OP_LTE) { Object rhs = pop(); Object lhs = pop(); push(lte(lhs, rhs)); } vmnext();
+                vmcase(OP_GT)  { Object rhs = pop(); Object lhs = pop(); push(gt(lhs, rhs)); } vmnext();
+                vmcase(OP_GTE) { Object rhs = pop(); Object lhs = pop(); push(gte(lhs, rhs)); } vmnext();
+                vmcase(OP_EQU) { Object rhs = pop(); Object lhs = pop(); push(equ(lhs, rhs)); } vmnext();
+                vmcase(OP_NEQ) { Object rhs = pop(); Object lhs = pop(); push(neq(lhs, rhs)); } vmnext();
+                vmcase(OP_NEG) push(neg(pop())); vmnext();
+                vmcase(OP_NOT) push(makeBool(!pop().data.boolval)); vmnext();
+                vmcase(OP_INCR) {
+                    Object& m = peek(0);
+                    if (m.type == AS_INT) {
+                        m.data.intval += ins->a;
+                    } else if (m.type == AS_REAL) {
+                        m.data.realval += ins->a;
+                    }
+                } vmnext();
+                vmcase(OP_JUMP) ip = ins->a; vmnext();
+                vmcase(OP_JUMP_FALSE) if (!pop().data.boolval) ip = ins->a; vmnext();
+                vmcase(OP_JUMP_FALSE_KEEP) if (!peek(0).data.boolval) ip = ins->a; else pop(); vmnext();
+                vmcase(OP_JUMP_TRUE_KEEP) if (peek(0).data.boolval) ip = ins->a; else pop(); vmnext();
+                vmcase(OP_PRINT) {
+                    cout<<toString(pop());
+                    if (ins->a) cout<<endl;
+                } vmnext();
+                vmcase(OP_DEF_FUNC) {
+                    store(ins->b, ins->c, makeFunction(frame->code->functions[ins->a]));
+                } vmnext();
+                vmcase(OP_LAMBDA) push(makeFunction(frame->code->functions[ins->a])); vmnext();
+                vmcase(OP_DEF_STRUCT) defineStruct(frame->code->structs[ins->a]); vmnext();
+                vmcase(OP_CALL) {
+                    frame->ip = ip;
+                    if (callFunction(ins->a, &frame->code->callsites[ins->b])) {
+                        frame = &frames.back();
+                        code = frame->code->code.data();
+                        ip = 0;
+                    }
+                } vmnext();
+                vmcase(OP_TAIL_CALL) {
+                    if (tailCall(ins->a, frame)) {
+                        code = frame->code->code.data();
+                        ip = 0;
+                    } else {
+                        frame->ip = ip;
+                        if (callFunction(ins->a, &frame->code->callsites[ins->b])) {
+                            frame = &frames.back();
+                            code = frame->code->code.data();
+                            ip = 0;
+                        }
+                    }
+                } vmnext();
+                vmcase(OP_RETURN) {
+                    Object result = pop();
+                    popTo(frame->base);
+                    cxt.unwindTo(frame->savedEnv);
+                    frames.pop_back();
+                    push(result);
+                    if (frames.size() <= stopDepth)
+                        return;
+                    frame = &frames.back();
+                    code = frame->code->code.data();
+                    ip = frame->ip;
+                } vmnext();
+                vmcase(OP_ENTER_SCOPE) cxt.openScope(ins->a); vmnext();
+                vmcase(OP_EXIT_SCOPE) cxt.closeScope(); vmnext();
+                vmcase(OP_MAKE_LIST) {
+                    List* list = new List();
+                    for (int i = ins->a - 1; i >= 0; i--)
+                        appendList(list, peek(i));
+                    popTo(cxt.getOperandStack().size() - ins->a);
+                    push(cxt.getAlloc().makeList(list));
+                } vmnext();
+                vmcase(OP_RANGE) {
+                    Object result = makeRangeList(cxt, peek(1), peek(0));
+                    pop(); pop();
+                    push(result);
+                } vmnext();
+                vmcase(OP_INDEX) {
+                    Object result = getSubscript(cxt, peek(1), peek(0), frame->code->strings[ins->a], fieldCache(frame->code, ins->a));
+                    pop(); pop();
+                    push(result);
+                } vmnext();
+                vmcase(OP_SLICE) {
+                    Object result = getSlice(cxt, peek(2), peek(1), peek(0));
+                    pop(); pop(); pop();
+                    push(result);
+                } vmnext();
+                vmcase(OP_STORE_INDEX) {
+                    Object result = setSubscript(cxt, peek(2), peek(1), frame->code->strings[ins->a], peek(0), fieldCache(frame->code, ins->a));
+                    pop(); pop(); pop();
+                    push(result);
+                } vmnext();
+                vmcase(OP_SIZE) push(getSize(pop())); vmnext();
+                vmcase(OP_EMPTY) push(getEmpty(pop())); vmnext();
+                vmcase(OP_FIRST) push(getFirst(pop())); vmnext();
+                vmcase(OP_REST) {
+                    Object result = getRest(cxt, peek(0));
+                    pop();
+                    push(result);
+                } vmnext();
+                vmcase(OP_APPEND) {
+                    Object value = pop();
+                    if (peek(0).type == AS_LIST) {
+                        auto held = cxt.getAlloc().writeBarrier(peek(0), value);
+                        appendList(getList(peek(0)), value);
+                    }
+                } vmnext();
+                vmcase(OP_PUSH) {
+                    Object value = pop();
+                    if (peek(0).type == AS_LIST) {
+                        auto held = cxt.getAlloc().writeBarrier(peek(0), value);
+                        pushList(getList(peek(0)), value);
+                    }
+                } vmnext();
+                vmcase(OP_MAP)
+                vmcase(OP_FILTER)
+                vmcase(OP_REDUCE)
+                vmcase(OP_SORT)
+                vmcase(OP_COMPREHEND) {
+                    frame->ip = ip;
+                    higherOrder(*ins);
+                    frame = &frames.back();
+                    code = frame->code->code.data();
+                } vmnext();
+                vmcase(OP_MATCHRE) {
+                    string pattern = *getString(pop());
+                    string text = *getString(pop());
+                    push(makeBool(matchre(text, pattern)));
+                } vmnext();
+                vmcase(OP_BLESS) push(blessStruct(cxt, frame->code->strings[ins->a])); vmnext();
+                vmcase(OP_DEREF) {
+                    if (typeOf(peek(0)) == AS_REF) {
+                        Object pointedAt = pop();
+                        push(cxt.get(pointedAt.data.reference->identifier, pointedAt.data.reference->scopelevel, pointedAt.data.reference->slot));
+                    }
+                } vmnext();
+                vmcase(OP_TYPEOF) {
+                    Object result = typeName(cxt, peek(0));
+                    pop();
+                    push(result);
+                } vmnext();
+                vmcase(OP_INCR_VAR) {
+                    Object m = load(ins->a, ins->b);
+                    if (m.type == AS_INT) {
+                        m.data.intval += ins->c;
+                    } else if (m.type == AS_REAL) {
+                        m.data.realval += ins->c;
+                    }
+                    store(ins->a, ins->b, m);
+                } vmnext();
+                vmcase(OP_ADD_VAR_K) {
+                    Object lhs = load(ins->a, ins->b);
+                    Object& rhs = frame->code->constants[ins->c];
+                    if (typeOf(lhs) == AS_STRING || typeOf(rhs) == AS_STRING) {
+                        store(ins->a, ins->b, concatenate(cxt, lhs, rhs));
+                    } else {
+                        store(ins->a, ins->b, add(lhs, rhs));
+                    }
+                } vmnext();
+                vmcase(OP_CMP_JUMP) {
+                    Object rhs = pop();
+                    Object lhs = pop();
+                    if (!compare(ins->b, lhs, rhs)) ip = ins->a;
+                } vmnext();
+                vmcase(OP_CMP_K_JUMP) {
+                    Object lhs = load(ins->b, ins->c);
+                    if (!compare(ins->e, lhs, frame->code->constants[ins->d])) ip = ins->a;
+                } vmnext();
+                vmcase(OP_LOAD_INDEXED) {
+                    Object list = load(ins->a, ins->b);
+                    Object index = load(ins->c, ins->d);
+                    push(getSubscript(cxt, list, index, frame->code->strings[ins->e], fieldCache(frame->code, ins->e)));
+                } vmnext();
+                vmcase(OP_HALT) {
+                    cxt.unwindTo(frame->savedEnv);
+                    frames.pop_back();
+                    return;
+                }
+                vmdefault()
+                    cout<<"Error: unknown instruction "<<ins->op<<endl;
+                    vmnext();
+            }
+        }
+        // Builtins which call back into script code. Arguments stay on the
+        // operand stack while they run, so everything they touch is rooted.
+        void higherOrder(Instruction& ins) {
+            Object result;
+            int argc = 0;
+            switch (ins.op) {
+                case OP_MAP:    result = mapList(*this, peek(1), peek(0)); argc = 2; break;
+                case OP_FILTER: result = filterList(*this, peek(1), peek(0)); argc = 2; break;
+                case OP_REDUCE: {
+                    argc = ins.a ? 3:2;
+                    result = reduceList(*this, peek(argc-1), peek(argc-2), ins.a ? peek(0):makeNil());
+                } break;
+                case OP_SORT: {
+                    argc = ins.a ? 2:1;
+                    result = sortList(*this, peek(argc-1), ins.a ? peek(0):makeNil());
+                } break;
+                case OP_COMPREHEND: {
+                    argc = ins.a ? 3:2;
+                    result = comprehension(*this, peek(argc-1), peek(argc-2), ins.a ? peek(0):makeNil());
+                } break;
+                default:
+                    break;
+            }
+            popTo(cxt.getOperandStack().size() - argc);
+            push(result);
+        }
+    public:
+        StackVM(bool debug = false) {
+            loud = debug;
+            worker = false;
+        }
+        // A vm for a worker thread of a parallel map, see parallel.hpp.
+        StackVM(StackVM* parent) : cxt(&parent->cxt) {
+            loud = false;
+            worker = true;
+        }
+        // Interns func's string literals up front, workers only read them.
+        void prepareParallel(Object func) {
+            CodeObject* code = getFunction(func)->proto->code;
+            for (int i = 0; i < code->strings.size(); i++)
+                literal(code, i);
+        }
+        void exec(astnode* node) {
+            CodeObject* program = compiler.compile(node);
+            if (loud)
+                disassemble(program);
+            int base = cxt.getOperandStack().size();
+            frames.push_back(CallFrame(program, base, makeNil(), cxt.getCallStack()));
+            run(frames.size() - 1);
+            popTo(base);
+        }
+        // Call a script function from native code and wait for its result.
+        Object invoke(Object func, Object* args, int argc) {
+            push(func);
+            for (int i = 0; i < argc; i++)
+                push(args[i]);
+            if (!callFunction(argc, nullptr))
+                return pop();
+            run(frames.size() - 1);
+            return pop();
+        }
+        Context& context() {
+            return cxt;
+        }
+};
+
+#endif
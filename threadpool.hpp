@@ -0,0 +1,95 @@
+#ifndef threadpool_hpp
+#define threadpool_hpp
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+/*
+    A fixed set of threads started on first use. run() hands them a batch
+    of tasks and returns once all of them have finished; the calling thread
+    works through the batch as well instead of sitting idle, so size()
+    counts it.
+*/
+class ThreadPool {
+    private:
+        vector<thread> threads;
+        mutex lock;
+        condition_variable wake;
+        condition_variable finished;
+        vector<function<void()>>* tasks;
+        int next;
+        int remaining;
+        bool stopping;
+        bool hasWork();
+        void runNext(unique_lock<mutex>& held);
+        void work();
+    public:
+        ThreadPool(int count);
+        ~ThreadPool();
+        int size();
+        void run(vector<function<void()>>& batch);
+};
+
+ThreadPool::ThreadPool(int count) {
+    tasks = nullptr;
+    next = 0;
+    remaining = 0;
+    stopping = false;
+    for (int i = 1; i < count; i++)
+        threads.push_back(thread([this]() { work(); }));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> held(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (thread& t : threads)
+        t.join();
+}
+
+int ThreadPool::size() {
+    return threads.size() + 1;
+}
+
+bool ThreadPool::hasWork() {
+    return tasks != nullptr && next < tasks->size();
+}
+
+// Takes the next task and runs it with the lock released.
+void ThreadPool::runNext(unique_lock<mutex>& held) {
+    function<void()>& task = (*tasks)[next++];
+    held.unlock();
+    task();
+    held.lock();
+    if (--remaining == 0)
+        finished.notify_all();
+}
+
+void ThreadPool::work() {
+    unique_lock<mutex> held(lock);
+    while (true) {
+        wake.wait(held, [this]() { return stopping || hasWork(); });
+        if (stopping)
+            return;
+        runNext(held);
+    }
+}
+
+void ThreadPool::run(vector<function<void()>>& batch) {
+    unique_lock<mutex> held(lock);
+    tasks = &batch;
+    next = 0;
+    remaining = batch.size();
+    wake.notify_all();
+    while (hasWork())
+        runNext(held);
+    finished.wait(held, [this]() { return remaining == 0; });
+    tasks = nullptr;
+}
+
+#endif
@@ -31,7 +31,9 @@ struct Token {
     Symbol symbol;
     string strval;
     int depth;
-    Token(Symbol s = TK_EOI, string st = " ", int d = -1) : symbol(s), strval(st), depth(d) { }
+    int slot;
+    bool captured;  // a local some closure captured, kept in a cell (see resolve.hpp)
+    Token(Symbol s = TK_EOI, string st = " ", int d = -1) : symbol(s), strval(st), depth(d), slot(-1), captured(false) { }
 };
 
 void printToken(Token tk) {
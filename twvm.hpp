@@ -5,16 +5,57 @@
 #include <unordered_map>
 #include "allocator.hpp"
 #include "ast.hpp"
+#include "builtins.hpp"
 #include "context.hpp"
+#include "purity.hpp"
 #include "object.hpp"
 #include "regex/patternmatcher.hpp"
 using namespace std;
 
+/*
+    The tree walker doesn't recurse on the C++ stack. What's left to do is a
+    stack of tasks, each a node and how far along it is: a handler does what
+    it can, and when it needs a child's value pushes itself back with its
+    next state and the child above that. Values live on the operand stack as
+    before. A statement in a list is queued IN_SEQUENCE, which first queues
+    the statement after it.
+
+    Each script call, and the top level, gets a TWFrame recording where the
+    task and operand stacks stood when it began and which scope to go back
+    to, so `return` just cuts both stacks back to it. The callee stays on the
+    operand stack under its frame, keeping it rooted. The only place the C++
+    stack still grows is a builtin calling back into script code through
+    invoke().
+*/
+
+const int IN_SEQUENCE = -1;
+
+struct Task {
+    astnode* node;      // nullptr is the end of a function body
+    int state;
+    int mark;           // operand stack size when the node started, if it needs it
+    Task(astnode* n = nullptr, int s = 0, int m = 0) : node(n), state(s), mark(m) { }
+};
+
+struct TWFrame {
+    Object func;                // nil for the top level
+    ActivationRecord* env;
+    ActivationRecord* savedEnv;
+    int taskBase;
+    int operandBase;
+    TWFrame(Object f, ActivationRecord* e, ActivationRecord* saved, int tb, int ob) : func(f), env(e), savedEnv(saved), taskBase(tb), operandBase(ob) { }
+};
+
 class TWVM {
     private:
-        bool bailout;
         bool loud;
         Context cxt;
+        vector<Task> tasks;
+        vector<TWFrame> frames;
+        vector<Object> constants;
+        vector<FieldCache> fieldCaches;
+        vector<FunctionProto*> prototypes;
+        unordered_map<astnode*, Object> references;
         void push(Object info) {
             cxt.getOperandStack().push(info);
         }
@@ -28,76 +69,261 @@ class TWVM {
         Object& peek(int spaces) {
             return cxt.getOperandStack().get(cxt.getOperandStack().size()-1-spaces);
         }
-        /* statement handlers */
-        void letStatement(astnode* node) {
-            evalExpr(node->child[0]);
+        void popTo(int size) {
+            while (cxt.getOperandStack().size() > size)
+                cxt.getOperandStack().pop();
         }
-        void ifStatement(astnode* node) {
-            evalExpr(node->child[0]);
-            if (pop().data.boolval) {
-                exec(node->child[1]);
+        /* task stack */
+        void then(astnode* node, int state, int mark = 0) {
+            tasks.push_back(Task(node, state, mark));
+        }
+        // Queues a, b and c to be evaluated in that order. A lone leaf is
+        // evaluated there and then.
+        void eval(astnode* a, astnode* b = nullptr, astnode* c = nullptr) {
+            if (b == nullptr && c == nullptr && evalLeaf(a))
+                return;
+            if (c != nullptr) tasks.push_back(Task(c));
+            if (b != nullptr) tasks.push_back(Task(b));
+            if (a != nullptr) tasks.push_back(Task(a));
+        }
+        bool isLeaf(astnode* node) {
+            return isExprType(node, ID_EXPR) || (isExprType(node, CONST_EXPR) && node->token.symbol != TK_TYPEOF);
+        }
+        // Constants, variables and a single operator on those are evaluated
+        // straight away rather than going through the task stack.
+        bool evalLeaf(astnode* node) {
+            if (isExprType(node, ID_EXPR)) {
+                idExpr(node);
+                return true;
+            }
+            if (isLeaf(node)) {
+                Task t(node);
+                constExpr(t);
+                return true;
+            }
+            if ((isExprType(node, BINOP_EXPR) || isExprType(node, RELOP_EXPR)) && isLeaf(node->child[0]) && isLeaf(node->child[1])) {
+                evalLeaf(node->child[0]);
+                evalLeaf(node->child[1]);
+                Task t(node, 1);
+                binaryOperation(t);
+                return true;
+            }
+            return false;
+        }
+        // Evaluates a, b and c in order for node, leaves right away and the
+        // rest after queuing node to carry on in state. True when there was
+        // nothing to queue, and the caller goes on to state itself.
+        bool operands(astnode* node, int state, astnode* a, astnode* b = nullptr, astnode* c = nullptr) {
+            astnode* ops[3] = { a, b, c };
+            int i = 0;
+            while (i < 3 && (ops[i] == nullptr || evalLeaf(ops[i])))
+                i++;
+            if (i == 3)
+                return true;
+            then(node, state);
+            eval(ops[i], i + 1 < 3 ? ops[i + 1]:nullptr, i + 2 < 3 ? ops[i + 2]:nullptr);
+            return false;
+        }
+        // Carries on with t in state straight away, for when operands()
+        // had nothing to queue.
+        void next(Task& t, int state) {
+            t.state = state;
+            evalExpr(t);
+        }
+        // A statement list, or the single expression a lambda body can be.
+        void execList(astnode* node) {
+            if (node != nullptr)
+                tasks.push_back(Task(node, node->nk == STMT_NODE ? IN_SEQUENCE:0));
+        }
+        void run(int stopDepth) {
+            while (tasks.size() > stopDepth) {
+                Task t = tasks.back();
+                tasks.pop_back();
+                if (t.node == nullptr) {
+                    leaveFunction(frameResult());
+                } else if (t.node->nk == STMT_NODE) {
+                    if (t.state == IN_SEQUENCE) {
+                        if (t.node->next != nullptr)
+                            tasks.push_back(Task(t.node->next, IN_SEQUENCE));
+                        t.state = 0;
+                    }
+                    evalStmt(t);
+                } else {
+                    evalExpr(t);
+                }
+            }
+        }
+        /* frames */
+        Object frameResult() {
+            return cxt.getOperandStack().size() > frames.back().operandBase ? peek(0):makeNil();
+        }
+        // Moves the argc values on top of the operand stack into func's
+        // param slots in env.
+        void bindArguments(Function* func, ActivationRecord* env, int argc) {
+            int i = 0;
+            for (astnode* param = func->proto->params; param != nullptr && i < argc; param = param->next) {
+                astnode* id = isExprType(param, REF_EXPR) ? param->child[0]:param;
+                env->slots[id->token.slot] = peek(argc - 1 - i++);
+            }
+            popTo(cxt.getOperandStack().size() - argc);
+        }
+        void startBody(Function* func) {
+            then(nullptr, 0);
+            execList(func->proto->body);
+        }
+        // Calls the function sitting under argc arguments on the operand stack.
+        void enterFunction(int argc) {
+            Object m = peek(argc);
+            Function* func = getFunction(m);
+            ActivationRecord* env = cxt.callRecord(m, cxt.getCallStack(), func->proto->frameSize);
+            bindArguments(func, env, argc);
+            frames.push_back(TWFrame(m, env, cxt.getCallStack(), tasks.size(), cxt.getOperandStack().size()));
+            cxt.openScope(env);
+            startBody(func);
+        }
+        // `return f(...)`: the current frame becomes f's, the callee taking
+        // over the caller's recycled activation record.
+        void tailCall(int argc) {
+            TWFrame& frame = frames.back();
+            IndexedStack<Object>& stack = cxt.getOperandStack();
+            int from = stack.size() - argc - 1;
+            for (int i = 0; i <= argc; i++)
+                stack.get(frame.operandBase - 1 + i) = stack.get(from + i);
+            popTo(frame.operandBase + argc);
+            tasks.resize(frame.taskBase);
+            Object m = peek(argc);
+            Function* func = getFunction(m);
+            cxt.unwindTo(frame.savedEnv);
+            frame.env = cxt.callRecord(m, frame.savedEnv, func->proto->frameSize);
+            bindArguments(func, frame.env, argc);
+            frame.func = m;
+            cxt.openScope(frame.env);
+            startBody(func);
+        }
+        // Unwinds the current frame from wherever it got to, and leaves
+        // result in place of the callee.
+        void leaveFunction(Object result) {
+            TWFrame frame = frames.back();
+            frames.pop_back();
+            tasks.resize(frame.taskBase);
+            cxt.unwindTo(frame.savedEnv);
+            if (frame.func.type == AS_NULL) {
+                popTo(frame.operandBase);
             } else {
-                exec(node->child[2]);
+                popTo(frame.operandBase - 1);
+                push(result);
             }
+            cxt.checkGC();
+        }
+        /* statement handlers */
+        // let and expression statements drop whatever value they leave,
+        // which a plain assignment never does.
+        void letStatement(Task& t) {
+            astnode* expr = t.node->child[0];
+            if (t.state != 0) {
+                popTo(t.mark);
+            } else if (isExprType(expr, ASSIGN_EXPR) && isExprType(expr->child[0], ID_EXPR)) {
+                Task assign(expr);
+                assignExpr(assign);
+            } else {
+                then(t.node, 1, cxt.getOperandStack().size());
+                eval(expr);
+            }
+        }
+        void ifStatement(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0]))
+                return;
+            execList(pop().data.boolval ? t.node->child[1]:t.node->child[2]);
         }
-        void whileStatement(astnode* node) {
-            evalExpr(node->child[0]);
-            while (pop().data.boolval) {
-                exec(node->child[1]);
-                exec(node->child[0]);
+        // The condition, then in state 1 the body and the loop again.
+        void whileStatement(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0]))
+                return;
+            if (pop().data.boolval) {
+                then(t.node, 0);
+                execList(t.node->child[1]);
             }
         }
-        void printStatement(astnode* node) {
-            evalExpr(node->child[0]);
+        void printStatement(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0]))
+                return;
             cout<<toString(pop());
-            if (node->token.symbol == TK_PRINTLN)
+            if (t.node->token.symbol == TK_PRINTLN)
                 cout<<endl;
         }
+        // The prototype a def or lambda node shares between all the
+        // closures it makes, built the first time it runs.
+        FunctionProto* prototype(astnode* node, const string& name) {
+            if (node->cacheIndex == -1) {
+                astnode* params = copyTree(node->child[0]);
+                astnode* body = copyTree(node->child[1]);
+                node->cacheIndex = prototypes.size();
+                prototypes.push_back(new FunctionProto(name, params, body, node->scopeSize, PurityChecker().isPure(params, body)));
+            }
+            return prototypes[node->cacheIndex];
+        }
+        Object makeClosure(astnode* node, const string& name) {
+            Function* func = new Function(prototype(node, name));
+            for (astnode* it = node->child[2]; it != nullptr; it = it->next)
+                func->upvalues.push_back(cxt.capture(it->token.depth, it->token.slot));
+            return cxt.getAlloc().makeFunction(func);
+        }
         void defineFunction(astnode* node) {
-            Function* func = new Function(copyTree(node->child[0]), copyTree(node->child[1]));
-            func->name = node->token.strval;
-            func->closure = cxt.getCallStack();
-            Object m = cxt.getAlloc().makeFunction(func);
-            cxt.insert(func->name, m);
+            Object m = makeClosure(node, node->token.strval);
+            cxt.put(node->token.strval, node->token.depth, node->token.slot, m);
         }
         void defineStruct(astnode* node) {
-            Struct* st = new Struct(node->child[0]->token.strval);
+            StructType* st = new StructType(node->child[0]->token.strval);
             for (astnode* it = node->child[1]; it != nullptr; it = it->next) {
-                st->fields[it->child[0]->token.strval] = makeNil();
+                st->addField(it->child[0]->token.strval);
             }
             cxt.addStructType(st);
         }
-        void blockStatement(astnode* node) {
-            cxt.openScope();
-            exec(node->child[0]);
-            cxt.closeScope();
+        void blockStatement(Task& t) {
+            if (t.node->scopeSize == NO_SCOPE) {
+                execList(t.node->child[0]);
+            } else if (t.state == 0) {
+                cxt.openScope(t.node->scopeSize);
+                then(t.node, 1);
+                execList(t.node->child[0]);
+            } else {
+                cxt.closeScope();
+            }
         }
-        void expressionStatement(astnode* node) {
-            evalExpr(node->child[0]);
+        void expressionStatement(Task& t) {
+            letStatement(t);
         }
-        void returnStatement(astnode* node) {
-            evalExpr(node->child[0]);
-            bailout = true;
+        void returnStatement(Task& t) {
+            if (t.state == 0) {
+                then(t.node, 1, cxt.getOperandStack().size());
+                eval(t.node->child[0]);
+            } else {
+                leaveFunction(cxt.getOperandStack().size() > t.mark ? peek(0):makeNil());
+            }
         }
         /* Expression Handlers */
-        Object resolveFunction(astnode* node) {
-            Object m;
-            if (isExprType(node->child[0], LAMBDA_EXPR)) {
-                evalExpr(node->child[0]);
-                m = pop();
-            } else if (node->child[0]->token.strval == "_rc") {
-                if (!cxt.getCallStack()->accessLink) {
-                    m = cxt.getCallStack()->bindings["_rc"];
+        // Pushes the function a call names, or queues evaluating it when
+        // it's a lambda or the result of another call and returns false.
+        bool resolveFunction(astnode* node) {
+            if (isExprType(node->child[0], LAMBDA_EXPR) || isExprType(node->child[0], FUNC_EXPR)) {
+                then(node, 1);
+                eval(node->child[0]);
+                return false;
+            } else if (node->child[0]->token.depth == CURRENT_FUNCTION_DEPTH) {
+                if (cxt.getCallStack()->function.type == AS_FUNC) {
+                    push(cxt.getCallStack()->function);
                 } else {
                     cout<<"Current scope is in the wrong context to re-call."<<endl;
+                    push(makeNil());
                 }
-            } else { 
-                m = cxt.get(node->child[0]->token.strval, node->child[0]->token.depth);
+            } else {
+                push(cxt.get(node->child[0]->token.strval, node->child[0]->token.depth, node->child[0]->token.slot));
             }
-            return m;
+            return true;
         }
-        void getType(astnode* node) {
-            evalExpr(node);
+        void getType(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0]))
+                return;
             string typeName = "nil";
             switch (pop().type) {
                 case AS_BOOL: typeName = "boolean"; break;
@@ -113,44 +339,74 @@ class TWVM {
             }
             push(cxt.getAlloc().makeString(typeName));
         }
-        void constExpr(astnode* node) {
-            switch (node->token.symbol) {
+        // Number literals and shared string ones are decoded the first time
+        // they're evaluated, after that the node just indexes the constant
+        // pool.
+        Object& literal(astnode* node) {
+            if (node->cacheIndex == -1) {
+                node->cacheIndex = constants.size();
+                constants.push_back(node->token.symbol == TK_NUM ? parseNumber(node->token.strval):cxt.getAlloc().internString(node->token.strval));
+            }
+            Object& k = constants[node->cacheIndex];
+            if (k.type == AS_STRING && !k.data.gcobj->immortal)
+                k = cxt.getAlloc().internString(node->token.strval);
+            return k;
+        }
+        void prepareCaches(astnode* node) {
+            for (; node != nullptr; node = node->next) {
+                if (isExprType(node, CONST_EXPR) && (node->token.symbol == TK_NUM || node->shared))
+                    literal(node);
+                if (isExprType(node, SUBSCRIPT_EXPR))
+                    fieldCache(node);
+                for (int i = 0; i < 3; i++)
+                    prepareCaches(node->child[i]);
+            }
+        }
+        FieldCache* fieldCache(astnode* node) {
+            if (node->cacheIndex == -1) {
+                node->cacheIndex = fieldCaches.size();
+                fieldCaches.push_back(FieldCache());
+            }
+            return &fieldCaches[node->cacheIndex];
+        }
+        // The reference a ref param is bound to for the identifier arg,
+        // made the first time that argument is passed and reused after.
+        Object reference(astnode* arg) {
+            auto it = references.find(arg);
+            if (it == references.end())
+                it = references.emplace(arg, makeReference(arg->token.strval, arg->token.depth, arg->token.slot)).first;
+            return it->second;
+        }
+        void constExpr(Task& t) {
+            switch (t.node->token.symbol) {
                 case TK_TRUE: push(makeBool(true)); break;
                 case TK_FALSE: push(makeBool(false)); break;
-                case TK_NUM: push(makeNumber(stoi(node->token.strval))); break;
-                case TK_STR: push(cxt.getAlloc().makeString(node->token.strval)); break;
+                case TK_NUM: push(literal(t.node)); break;
+                case TK_STR: push(t.node->shared ? literal(t.node):cxt.getAlloc().makeString(t.node->token.strval)); break;
                 case TK_NIL: push(cxt.nil()); break;
-                case TK_TYPEOF: getType(node->child[0]); break;
-                default: 
+                case TK_TYPEOF: getType(t); break;
+                default:
                     break;
             }
         }
-        void rangeExpression(astnode* node) {
-            evalExpr(node->child[0]);
-            Object lhs = pop();
-            int l = lhs.data.intval;
-            evalExpr(node->child[1]);
-            Object rhs = pop();
-            int r = rhs.data.intval;
-            List* nl = new List();
-            if (l < r) {
-                for (int i = l; i <= r; i++)
-                    nl = appendList(nl, makeInt(i));
-            } else {
-                for (int i = l; i >= r; i--)
-                    nl = appendList(nl, makeInt(i));
-            }
-            push(cxt.getAlloc().makeList(nl));
+        void rangeExpression(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0], t.node->child[1]))
+                return;
+            int r = pop().data.intval;
+            int l = pop().data.intval;
+            push(cxt.getAlloc().makeList(rangeList(l, r)));
         }
         void idExpr(astnode* node) {
-            Object m = cxt.get(node->token.strval, node->token.depth);
+            Object m = cxt.get(node->token.strval, node->token.depth, node->token.slot);
             if (typeOf(m) == AS_REF) {
                 cout<<"Oh snap, a reference! "<<node->token.strval<<" is pointing to something else! "<<endl;
-                push(cxt.get(m.data.reference->identifier, m.data.reference->scopelevel));
+                push(cxt.get(m.data.reference->identifier, m.data.reference->scopelevel, m.data.reference->slot));
             } else push(m);
         }
-        void unaryOperation(astnode* node) {
-            evalExpr(node->child[0]);
+        void unaryOperation(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0]))
+                return;
+            astnode* node = t.node;
             switch (node->token.symbol) {
                 case TK_NOT: push(makeBool(!pop().data.boolval)); break;
                 case TK_SUB: push(neg(pop())); break;
@@ -161,7 +417,7 @@ class TWVM {
                     } else if (m.type == AS_REAL) {
                         m.data.realval -= 1;
                     }
-                    cxt.put(node->child[0]->token.strval, node->child[0]->token.depth, m);
+                    cxt.put(node->child[0]->token.strval, node->child[0]->token.depth, node->child[0]->token.slot, m);
                 } break;
                 case TK_POST_INC: {
                     Object m = pop();
@@ -170,14 +426,15 @@ class TWVM {
                     } else if (m.type == AS_REAL) {
                         m.data.realval += 1;
                     }
-                    cxt.put(node->child[0]->token.strval, node->child[0]->token.depth, m);
+                    cxt.put(node->child[0]->token.strval, node->child[0]->token.depth, node->child[0]->token.slot, m);
                 } break;
                 default: break;
             }
         }
-        void binaryOperation(astnode* node) {
-            evalExpr(node->child[0]);
-            evalExpr(node->child[1]);
+        void binaryOperation(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0], t.node->child[1]))
+                return;
+            astnode* node = t.node;
             if (node->token.symbol == TK_ADD && (typeOf(peek(0)) == AS_STRING || typeOf(peek(1)) == AS_STRING)) {
                 string newstr = toString(peek(1)) + toString(peek(0));
                 Object result = cxt.getAlloc().makeString(newstr);
@@ -204,168 +461,196 @@ class TWVM {
                     break;
             }
         }
-        void assignExpr(astnode* node) {
+        void assignExpr(Task& t) {
+            astnode* node = t.node;
             if (isExprType(node->child[0], ID_EXPR)) {
-                evalExpr(node->child[1]);
-                cxt.put(node->child[0]->token.strval, node->child[0]->token.depth, pop());
+                if (t.state == 0 && !operands(node, 1, node->child[1]))
+                    return;
+                cxt.put(node->child[0]->token.strval, node->child[0]->token.depth, node->child[0]->token.slot, pop());
             } else if (isExprType(node->child[0], SUBSCRIPT_EXPR)) {
-                subscriptAssignment(node);
+                subscriptAssignment(t);
             }
         }
-        void subscriptAssignment(astnode* node) {
+        // The container is evaluated first and stays on the operand stack
+        // until the index and value are; state 1 picks by its type.
+        void subscriptAssignment(Task& t) {
+            astnode* node = t.node;
             astnode* tnode = node->child[0];
-            evalExpr(tnode->child[0]);
-            if (peek(0).type == AS_LIST) {
-                List* list = getList(pop());
-                evalExpr(tnode->child[1]);
-                int pos = 0;
-                int indx = pop().data.intval;
-                ListNode* itr = list->head;
-                while (itr != nullptr && pos < indx) {
-                    pos++;
-                    itr = itr->next;
-                }
-                evalExpr(node->child[1]);
-                if (itr != nullptr) itr->info = pop();
-            } else if (peek(0).type == AS_STRUCT) {
-                Struct* st = getStruct(pop());
-                string name = tnode->child[1]->token.strval;
-                if (st->fields.find(name) == st->fields.end()) {
-                    cout<<"Object doesnt have field '"<<name<<"'"<<endl;
-                    return;
-                }
-                evalExpr(node->child[1]);
-                st->fields[name] = pop();
-            } else if (peek(0).type == AS_STRING) {
-                Object strObj = pop();
-                string* str = getString(strObj);
-                evalExpr(tnode->child[1]);
-                int indx = getInteger(pop());
-                if (indx < 0 || indx > str->length()) {
-                    cout<<"Index out of range: "<<indx<<endl;
-                    return;
-                }
-                string back = str->substr(indx+1);
-                string front = str->substr(0, indx);
-                evalExpr(node->child[1]);
-                string toins = *getString(pop());
-                str = new string(front+toins+back);
-                strObj.data.gcobj->strval = str;
-                push(strObj);
-            }
-        }
-        void subscriptExpression(astnode* node) {
-            evalExpr(node->child[0]);
-            if (peek(0).type == AS_LIST) {
-                List* list = getList(pop());
-                evalExpr(node->child[1]);
-                int i = 0;
-                int indx = pop().data.intval;
-                ListNode* itr = list->head;
-                while (itr != nullptr && i < indx) {
-                    i++;
-                    itr = itr->next;
-                }
-                if (itr != nullptr) push(itr->info);
-            } else if (peek(0).type == AS_STRUCT) {
-                Struct* st = getStruct(pop());
-                string name = node->child[1]->token.strval;
-                if (st->fields.find(name) == st->fields.end()) {
-                    cout<<"Object doesnt have field '"<<name<<"'"<<endl;
-                    return;
-                }
-                push(st->fields[name]);
-            } else if (peek(0).type == AS_STRING) {
-                string* str = getString(pop());
-                evalExpr(node->child[1]);
-                int indx = getInteger(pop());
-                if (indx < 0 || indx > str->length()) {
-                    cout<<"Index out of range: "<<indx<<endl;
-                    return;
-                }
-                char c = str->at(indx);
-                string tmp;
-                tmp.push_back(c);
-                push(cxt.getAlloc().makeString(tmp));
+            switch (t.state) {
+                case 0:
+                    if (operands(node, 1, tnode->child[0]))
+                        next(t, 1);
+                    break;
+                case 1:
+                    if (peek(0).type == AS_LIST) {
+                        if (operands(node, 2, tnode->child[1], node->child[1]))
+                            next(t, 2);
+                    } else if (peek(0).type == AS_STRUCT) {
+                        if (getField(getStruct(peek(0)), tnode->child[1]->token.strval, fieldCache(tnode)) == nullptr) {
+                            pop();
+                            cout<<"Object doesnt have field '"<<tnode->child[1]->token.strval<<"'"<<endl;
+                            return;
+                        }
+                        if (operands(node, 3, node->child[1]))
+                            next(t, 3);
+                    } else if (peek(0).type == AS_STRING) {
+                        if (operands(node, 4, tnode->child[1], node->child[1]))
+                            next(t, 4);
+                    }
+                    break;
+                case 2: {
+                    Object value = pop();
+                    int indx = pop().data.intval;
+                    Object listObj = pop();
+                    auto held = cxt.getAlloc().writeBarrier(listObj, value);
+                    updateListAt(getList(listObj), indx, value);
+                } break;
+                case 3: {
+                    Object value = pop();
+                    Object structObj = pop();
+                    auto held = cxt.getAlloc().writeBarrier(structObj, value);
+                    *getField(getStruct(structObj), tnode->child[1]->token.strval, fieldCache(tnode)) = value;
+                } break;
+                case 4: {
+                    Object value = pop();
+                    Object indx = pop();
+                    setSubscript(cxt, pop(), indx, "", value);
+                } break;
+                default:
+                    break;
             }
         }
-        void functionCall(astnode* node) {
-            Object m;
-            if (isExprType(node->child[0], FUNC_EXPR)) {
-                evalExpr(node->child[0]);
-                m = pop();
-            } else {
-                m = resolveFunction(node);
+        void subscriptExpression(Task& t) {
+            astnode* node = t.node;
+            switch (t.state) {
+                case 0:
+                    if (operands(node, 1, node->child[0]))
+                        next(t, 1);
+                    break;
+                case 1:
+                    if (isExprType(node->child[1], RANGE_EXPR)) {
+                        if (operands(node, 2, node->child[1]->child[0], node->child[1]->child[1]))
+                            next(t, 2);
+                    } else if (peek(0).type == AS_LIST) {
+                        if (operands(node, 3, node->child[1]))
+                            next(t, 3);
+                    } else if (peek(0).type == AS_STRUCT) {
+                        Object* field = getField(getStruct(pop()), node->child[1]->token.strval, fieldCache(node));
+                        if (field == nullptr) {
+                            cout<<"Object doesnt have field '"<<node->child[1]->token.strval<<"'"<<endl;
+                            return;
+                        }
+                        push(*field);
+                    } else if (peek(0).type == AS_STRING) {
+                        if (operands(node, 4, node->child[1]))
+                            next(t, 4);
+                    }
+                    break;
+                case 2: {
+                    Object result = getSlice(cxt, peek(2), peek(1), peek(0));
+                    pop(); pop(); pop();
+                    push(result);
+                } break;
+                case 3:
+                case 4: {
+                    Object result = getSubscript(cxt, peek(1), peek(0), "");
+                    pop(); pop();
+                    push(result);
+                } break;
+                default:
+                    break;
             }
+        }
+        // State 0 gets the callee onto the operand stack. In state n the
+        // first n - 1 arguments are above it and the next is evaluated, or
+        // for a ref param bound to where the argument lives. Arguments past
+        // the last param aren't evaluated.
+        void functionCall(Task& t) {
+            astnode* node = t.node;
+            if (t.state == 0) {
+                if (!resolveFunction(node))
+                    return;
+                t.state = 1;
+            }
+            int argc = t.state - 1;
+            Object m = peek(argc);
             if (m.type != AS_FUNC) {
+                pop();
                 cout<<"Couldn't find function named: "<<node->child[0]->token.strval<<endl;
                 return;
             }
-            Function* func = m.data.gcobj->funcval;
-            funcExpression(func, node->child[1]);
-        }
-        void lambdaExpression(astnode* node) {
-            Function* func = new Function(copyTree(node->child[0]), copyTree(node->child[1]));
-            func->name = "(lambda)";
-            func->closure = cxt.getCallStack();
-            push(cxt.getAlloc().makeFunction(func));
-        }
-        void evalFunctionArguments(astnode* args, astnode* params, ActivationRecord*& env) {
-            int i = 0;
-            while (params != nullptr && args != nullptr) {
-                if (isExprType(params, REF_EXPR)) {
+            astnode* param = getFunction(m)->proto->params;
+            astnode* arg = node->child[1];
+            for (int i = 0; i < argc; i++) {
+                param = param->next;
+                arg = arg->next;
+            }
+            while (param != nullptr && arg != nullptr) {
+                if (isExprType(param, REF_EXPR)) {
                     cout<<"Bound arg as reference."<<endl;
-                    env->bindings[params->child[0]->token.strval] = makeReference(args->token.strval, args->token.depth);
-                } else {
-                    evalExpr(args);
-                    Object tmp = pop();
-                    env->bindings.insert(make_pair(params->token.strval, tmp)); 
+                    push(reference(arg));
+                } else if (!evalLeaf(arg)) {
+                    then(node, argc + 2);
+                    eval(arg);
+                    return;
                 }
-                params = params->next;
-                args = args->next;
-                i++;
+                param = param->next;
+                arg = arg->next;
+                argc++;
             }
+            if (node->tail != NOT_TAIL_CALL && frames.back().func.type == AS_FUNC && !hasRefParams(getFunction(m)))
+                tailCall(argc);
+            else
+                enterFunction(argc);
         }
-        void funcExpression(Function* func, astnode* params) {
-            ActivationRecord* env = new ActivationRecord(func->closure, cxt.getCallStack());
-            evalFunctionArguments(params, func->params, env);
-            cxt.openScope(env);
-            cxt.insert("_rc", cxt.getAlloc().makeFunction(func));
-            exec(func->body);
-            bailout = false;
-            cxt.closeScope();
+        // Ref params would point into the frame a tail call throws away.
+        bool hasRefParams(Function* func) {
+            for (astnode* it = func->proto->params; it != nullptr; it = it->next) {
+                if (isExprType(it, REF_EXPR))
+                    return true;
+            }
+            return false;
+        }
+        void lambdaExpression(astnode* node) {
+            push(makeClosure(node, "(lambda)"));
         }
-        void listExpression(astnode* node) {
+        // Everything but a list literal evaluates its operands first.
+        void listExpression(Task& t) {
+            astnode* node = t.node;
+            if (node->token.symbol == TK_LB) {
+                makeAnonymousList(t);
+                return;
+            }
+            if (t.state == 0 && !operands(node, 1, node->child[0], node->child[1], node->child[2]))
+                return;
             switch (node->token.symbol) {
-                case TK_LB: makeAnonymousList(node); break;
-                case TK_SIZE: getListSize(node); break;
-                case TK_EMPTY: getListEmpty(node); break;
-                case TK_APPEND: doAppendList(node); break;
-                case TK_PUSH:   doPushList(node); break;
-                case TK_FIRST:  getFirstListElement(node); break;
-                case TK_REST:   getRestOfList(node); break;
-                case TK_MAP:    doMap(node);break;
-                case TK_FILTER: doFilter(node); break;
+                case TK_SIZE: getListSize(); break;
+                case TK_EMPTY: getListEmpty(); break;
+                case TK_APPEND: doAppendList(); break;
+                case TK_PUSH:   doPushList(); break;
+                case TK_FIRST:  getFirstListElement(); break;
+                case TK_REST:   getRestOfList(); break;
+                case TK_MAP:    doMap();break;
+                case TK_FILTER: doFilter(); break;
                 case TK_REDUCE: doReduce(node); break;
                 case TK_SORT: doSort(node); break;
                 default:
                     break;
             }
         }
-        void doAppendList(astnode* node) {
-            evalExpr(node->child[0]);
-            List* list = getList(pop());
-            evalExpr(node->child[1]);
-            list = appendList(list, pop());
+        void doAppendList() {
+            Object value = pop();
+            Object listObj = pop();
+            auto held = cxt.getAlloc().writeBarrier(listObj, value);
+            appendList(getList(listObj), value);
         }
-        void doPushList(astnode* node) {
-            evalExpr(node->child[0]);
-            List* list = getList(pop());
-            evalExpr(node->child[1]);
-            list = pushList(list, pop());
+        void doPushList() {
+            Object value = pop();
+            Object listObj = pop();
+            auto held = cxt.getAlloc().writeBarrier(listObj, value);
+            pushList(getList(listObj), value);
         }
-        void getListSize(astnode* node) {
-            evalExpr(node->child[0]);
+        void getListSize() {
             int size = 0;
             Object m = pop();
             if (m.type != AS_LIST && m.type != AS_STRING) {
@@ -374,264 +659,169 @@ class TWVM {
                 return;
             }
             switch (m.type) {
-                case AS_LIST: size = m.data.gcobj->listval->count; break;
+                case AS_LIST: size = listSize(m.data.gcobj->listval); break;
                 case AS_STRING: size = m.data.gcobj->strval->size(); break;
                 default: break;
             }
             push(makeInt(size));
         }
-        void getListEmpty(astnode* node) {
-            evalExpr(node->child[0]);
-            push(makeBool(getList(pop())->head == nullptr));
+        void getListEmpty() {
+            push(makeBool(listEmpty(getList(pop()))));
         }
-        void getFirstListElement(astnode* node) {
-            evalExpr(node->child[0]);
-            push(getList(pop())->head->info);
+        void getFirstListElement() {
+            push(listGet(getList(pop()), 0));
         }
-        void getRestOfList(astnode* node) {
-            evalExpr(node->child[0]);
-            List* list = getList(pop());
-            List* nl = new List();
-            for (ListNode* it = list->head->next; it != nullptr; it = it->next)
-                nl = appendList(nl, it->info);
-            push(cxt.getAlloc().makeList(nl));
+        void getRestOfList() {
+            push(cxt.getAlloc().makeList(restList(getList(pop()))));
         }
-        Symbol getSymbol(Object m) {
-            switch (m.type) {
-                case AS_INT: return TK_NUM;
-                case AS_REAL: return TK_NUM;
-                case AS_BOOL: return m.data.boolval ? TK_TRUE:TK_FALSE;
-                case AS_STRING: return TK_ID;
-                case AS_LIST: return TK_LB;
-                case AS_FUNC: return TK_LAMBDA;
-                default:
-                    break;
-            }
-            return TK_NIL;
-        }
-        void doMap(astnode* node) {
-            evalExpr(node->child[0]);
-            List* list = getList(pop());
-            evalExpr(node->child[1]);
-            Function* func = getFunction(pop());
-            List* result = new List();
-            for (ListNode* it = list->head; it != nullptr; it = it->next) {
-                astnode* t = makeExprNode(CONST_EXPR, Token(getSymbol(it->info), toString(it->info)));
-                funcExpression(func, t);
-                result = appendList(result, pop());
-            }
-            push(cxt.getAlloc().makeList(result));
-        }
-        void doFilter(astnode* node) {
-            evalExpr(node->child[0]);
-            List* list = getList(pop());
-            evalExpr(node->child[1]);
-            Function* func = getFunction(pop());
-            List* result = new List();
-            for (ListNode* it = list->head; it != nullptr; it = it->next) {
-                astnode* t = makeExprNode(CONST_EXPR, Token(getSymbol(it->info), toString(it->info)));
-                funcExpression(func, t);
-                if (pop().data.boolval)
-                    result = appendList(result, it->info);
-            }
-            push(cxt.getAlloc().makeList(result));
+        // The list and the function stay on the operand stack while the
+        // builtin calls back into script code through invoke().
+        void doMap() {
+            Object result = mapList(*this, peek(1), peek(0));
+            pop(); pop();
+            push(result);
         }
-        void doReduce(astnode* node) {
-            evalExpr(node->child[0]);
-            List* list = getList(pop());
-            evalExpr(node->child[1]);
-            Function* func = getFunction(pop());
-            ListNode* it = list->head; 
-            Object result = it->info;
-            it = it->next;
-            while (it != nullptr) {
-                astnode* t = makeExprNode(CONST_EXPR, Token(getSymbol(result), toString(result)));
-                t->next = makeExprNode(CONST_EXPR, Token(getSymbol(it->info), toString(it->info)));
-                funcExpression(func, t);
-                result = pop();
-                it = it->next;
-            }
+        void doFilter() {
+            Object result = filterList(*this, peek(1), peek(0));
+            pop(); pop();
             push(result);
         }
-        ListNode* mergesort(ListNode* head, Function* cmplambda) {
-            if (head == nullptr || head->next == nullptr)
-                return head;
-            ListNode* fast = head->next;
-            ListNode* slow = head;
-            while (fast != nullptr && fast->next != nullptr) {
-                slow = slow->next;
-                fast = fast->next->next;
-            }
-            ListNode* back = slow->next;
-            slow->next = nullptr;
-            head = mergesort(head, cmplambda);
-            back = mergesort(back, cmplambda);
-            ListNode d; ListNode* c = &d;
-            while (head != nullptr && back != nullptr) {
-                if (cmplambda != nullptr) {
-                    astnode* t = makeExprNode(CONST_EXPR, Token(getSymbol(head->info), toString(head->info)));
-                    t->next = makeExprNode(CONST_EXPR, Token(getSymbol(back->info), toString(back->info)));
-                    funcExpression(cmplambda, t);
-                } else {
-                    push(gt(back->info, head->info));
-                }
-                Object result = pop();
-                if (result.data.boolval) {
-                    c->next = head; head = head->next; c = c->next;
-                } else {
-                    c->next = back; back = back->next; c = c->next;
-                }
-            }
-            c->next = (head == nullptr) ? back:head;
-            head = d.next;
-            return head;
+        void doReduce(astnode* node) {
+            if (node->child[2] == nullptr)
+                push(makeNil());
+            Object result = reduceList(*this, peek(2), peek(1), peek(0));
+            pop(); pop(); pop();
+            push(result);
         }
         void doSort(astnode* node) {
-            evalExpr(node->child[0]);
-            Object listObj = pop();
-            if (listObj.type != AS_LIST) {
-                cout<<"Error: sort expects a list"<<endl;
-                return;
-            }
-            Function* cmp = nullptr;
-            if (node->child[1] != nullptr) {
-                evalExpr(node->child[1]);
-                cmp = getFunction(pop());
-            }
-            List* list = listObj.data.gcobj->listval;
-            if (!listEmpty(list)) {
-                list->head = mergesort(list->head, cmp);
-                ListNode* x = list->head;
-                while (x->next != nullptr) x = x->next;
-                list->tail = x;
-            }
-            push(listObj);
+            if (node->child[1] == nullptr)
+                push(makeNil());
+            Object result = sortList(*this, peek(1), peek(0));
+            pop(); pop();
+            if (result.type == AS_LIST)
+                push(result);
         }
-        void makeAnonymousList(astnode* node) { 
-            List* list = new List();
-            for (astnode* it = node->child[0]; it != nullptr; it = it->next) {
-                evalExpr(it);
-                list = appendList(list, pop());
+        // The elements are evaluated onto the operand stack above mark.
+        void makeAnonymousList(Task& t) {
+            if (t.state == 0) {
+                t.mark = cxt.getOperandStack().size();
+                astnode* it = t.node->child[0];
+                while (it != nullptr && evalLeaf(it))
+                    it = it->next;
+                if (it != nullptr) {
+                    then(t.node, 1, t.mark);
+                    vector<astnode*> items;
+                    for (; it != nullptr; it = it->next)
+                        items.push_back(it);
+                    for (int i = items.size() - 1; i >= 0; i--)
+                        tasks.push_back(Task(items[i]));
+                    return;
+                }
             }
+            List* list = new List();
+            for (int i = t.mark; i < cxt.getOperandStack().size(); i++)
+                list = appendList(list, cxt.getOperandStack().get(i));
+            popTo(t.mark);
             push(cxt.getAlloc().makeList(list));
         }
-        void listComprehension(astnode* node) {
-            evalExpr(node->child[0]);
-            Object listobj = pop();
-            if (listobj.type != AS_LIST) {
-                cout<<"Error: list comprehensions only work on lists."<<endl;
+        void listComprehension(Task& t) {
+            astnode* node = t.node;
+            if (t.state == 0 && !operands(node, 1, node->child[0], node->child[1], node->child[2]))
                 return;
-            }
-            evalExpr(node->child[1]);
-            Function* func = getFunction(pop());
-            Function* pred = nullptr;
-            if (node->child[2] != nullptr) {
-                evalExpr(node->child[2]);
-                pred = getFunction(pop());
-            }
-            List* list = getList(listobj);
-            List* result = new List();
-            for (ListNode* it = list->head; it != nullptr; it = it->next) {
-                astnode* t = makeExprNode(CONST_EXPR, Token(getSymbol(it->info), toString(it->info)));
-                if (pred != nullptr) {
-                    funcExpression(pred, t);
-                    if (pop().data.boolval) {
-                        funcExpression(func, t);
-                        result = appendList(result, pop());
-                    }
-                } else {
-                    funcExpression(func, t);
-                    result = appendList(result, pop());
-                }
-            }
-            push(cxt.getAlloc().makeList(result));
+            if (node->child[2] == nullptr)
+                push(makeNil());
+            Object result = comprehension(*this, peek(2), peek(1), peek(0));
+            pop(); pop(); pop();
+            push(result);
         }
-        void regularExpression(astnode* node) {
-            evalExpr(node->child[0]);
-            string text = *getString(pop());
-            evalExpr(node->child[1]);
+        void regularExpression(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0], t.node->child[1]))
+                return;
             string pattern = *getString(pop());
+            string text = *getString(pop());
             push(makeBool(matchre(text, pattern)));
         }
         void blessExpression(astnode* node) {
             string name = node->child[0]->token.strval;
-            Struct* st = cxt.getInstanceType(name);
-            if (st == nullptr) {
+            StructType* type = cxt.getInstanceType(name);
+            if (type == nullptr) {
                 cout<<"No such type '"<<name<<"'"<<endl;
                 return;
             }
-            Struct* nextInstance = new Struct(st->typeName);
-            for (auto m : st->fields) {
-                nextInstance->fields[m.first] = m.second;
-            }
+            Struct* nextInstance = new Struct(type);
             nextInstance->blessed = true;
             push(cxt.getAlloc().makeStruct(nextInstance));
         }
-        void booleanOperation(astnode* node) {
-            if (node->token.symbol == TK_AND) {
-                evalExpr(node->child[0]);
+        void booleanOperation(Task& t) {
+            astnode* node = t.node;
+            if (t.state == 0) {
+                then(node, 1);
+                eval(node->child[0]);
+            } else if (node->token.symbol == TK_AND) {
                 if (peek(0).data.boolval) {
                     pop();
-                    evalExpr(node->child[1]);
+                    eval(node->child[1]);
                 }
             } else if (node->token.symbol == TK_OR) {
-                evalExpr(node->child[0]);
                 if (!peek(0).data.boolval) {
                     pop();
-                    evalExpr(node->child[1]);
+                    eval(node->child[1]);
                 }
             }
         }
-        void ternaryConditional(astnode* node) {
-            evalExpr(node->child[0]);
-            if   (getBoolean(pop())) evalExpr(node->child[1]);
-            else evalExpr(node->child[2]);
+        void ternaryConditional(Task& t) {
+            if (t.state == 0) {
+                then(t.node, 1);
+                eval(t.node->child[0]);
+            } else {
+                eval(getBoolean(pop()) ? t.node->child[1]:t.node->child[2]);
+            }
         }
-        void referenceExpression(astnode* node) {
-            evalExpr(node->child[0]);
+        void referenceExpression(Task& t) {
+            if (t.state == 0 && !operands(t.node, 1, t.node->child[0]))
+                return;
             Object pointedAt = pop();
             if (typeOf(pointedAt) == AS_REF) {
-                Object deref = cxt.get(pointedAt.data.reference->identifier, pointedAt.data.reference->scopelevel);
+                Object deref = cxt.get(pointedAt.data.reference->identifier, pointedAt.data.reference->scopelevel, pointedAt.data.reference->slot);
                 cout<<"De referenced "<<toString(deref)<<" from "<<toString(pointedAt)<<endl;
                 push(deref);
             }
         }
-        void evalExpr(astnode* node) {
-            if (node != nullptr) {
-                switch (node->type.expr) {
-                    case UNOP_EXPR: unaryOperation(node); break;
-                    case RELOP_EXPR: binaryOperation(node); break;
-                    case BINOP_EXPR: binaryOperation(node); break;
-                    case TERNARY_EXPR: ternaryConditional(node); break;
-                    case LOGIC_EXPR: booleanOperation(node); break;
-                    case ASSIGN_EXPR: assignExpr(node); break;
-                    case CONST_EXPR: constExpr(node); break;
-                    case ID_EXPR:    idExpr(node); break;
-                    case FUNC_EXPR:  functionCall(node); break;
-                    case LIST_EXPR:  listExpression(node); break;
-                    case SUBSCRIPT_EXPR: subscriptExpression(node); break;
-                    case REG_EXPR:   regularExpression(node); break;
-                    case REF_EXPR:   referenceExpression(node); break;
-                    case LAMBDA_EXPR: lambdaExpression(node); break;
-                    case RANGE_EXPR:  rangeExpression(node); break;
-                    case ZF_EXPR:     listComprehension(node); break;
-                    case BLESS_EXPR:  blessExpression(node); break;
-                    default:
-                        break;
-                }
+        void evalExpr(Task& t) {
+            astnode* node = t.node;
+            switch (node->type.expr) {
+                case UNOP_EXPR: unaryOperation(t); break;
+                case RELOP_EXPR: binaryOperation(t); break;
+                case BINOP_EXPR: binaryOperation(t); break;
+                case TERNARY_EXPR: ternaryConditional(t); break;
+                case LOGIC_EXPR: booleanOperation(t); break;
+                case ASSIGN_EXPR: assignExpr(t); break;
+                case CONST_EXPR: constExpr(t); break;
+                case ID_EXPR:    idExpr(node); break;
+                case FUNC_EXPR:  functionCall(t); break;
+                case LIST_EXPR:  listExpression(t); break;
+                case SUBSCRIPT_EXPR: subscriptExpression(t); break;
+                case REG_EXPR:   regularExpression(t); break;
+                case REF_EXPR:   referenceExpression(t); break;
+                case LAMBDA_EXPR: lambdaExpression(node); break;
+                case RANGE_EXPR:  rangeExpression(t); break;
+                case ZF_EXPR:     listComprehension(t); break;
+                case BLESS_EXPR:  blessExpression(node); break;
+                default:
+                    break;
             }
         }
-        void evalStmt(astnode* node) {
-            switch (node->type.stmt) {
-                case LET_STMT: letStatement(node); break;
-                case IF_STMT:  ifStatement(node); break;
-                case WHILE_STMT: whileStatement(node); break;
-                case PRINT_STMT: printStatement(node); break;
-                case EXPR_STMT: expressionStatement(node); break;
-                case FUNC_DEF_STMT: defineFunction(node); break;
-                case RETURN_STMT: returnStatement(node); break;
-                case BLOCK_STMT: blockStatement(node); break;
-                case STRUCT_DEF_STMT: defineStruct(node); break;
+        void evalStmt(Task& t) {
+            switch (t.node->type.stmt) {
+                case LET_STMT: letStatement(t); break;
+                case IF_STMT:  ifStatement(t); break;
+                case WHILE_STMT: whileStatement(t); break;
+                case PRINT_STMT: printStatement(t); break;
+                case EXPR_STMT: expressionStatement(t); break;
+                case FUNC_DEF_STMT: defineFunction(t.node); break;
+                case RETURN_STMT: returnStatement(t); break;
+                case BLOCK_STMT: blockStatement(t); break;
+                case STRUCT_DEF_STMT: defineStruct(t.node); break;
                 default:
                     break;
             }
@@ -639,22 +829,43 @@ class TWVM {
     public:
         TWVM(bool debug = false) {
             loud = debug;
-            bailout = false;
         }
+        // A vm for a worker thread of a parallel map, see parallel.hpp. It
+        // gets its own copy of the literal pool, field caches and prototypes.
+        TWVM(TWVM* parent) : cxt(&parent->cxt), constants(parent->constants), fieldCaches(parent->fieldCaches), prototypes(parent->prototypes) {
+            loud = false;
+        }
+        // Gives every literal and field access in func a cache entry now,
+        // so the workers' copies already have them.
+        void prepareParallel(Object func) {
+            prepareCaches(getFunction(func)->proto->body);
+        }
+        // Runs a program, or a line of the repl, in a top level frame.
         void exec(astnode* node) {
-            if (node != nullptr) {
-                if (node->nk == STMT_NODE) {
-                    evalStmt(node);
-                } else {
-                    evalExpr(node);
-                }
-                if (!bailout)
-                    exec(node->next);
-            }
+            int base = tasks.size();
+            frames.push_back(TWFrame(makeNil(), cxt.getCallStack(), cxt.getCallStack(), base, cxt.getOperandStack().size()));
+            then(nullptr, 0);
+            execList(node);
+            run(base);
+        }
+        // Call a script function from native code with already evaluated
+        // arguments and wait for its result.
+        Object invoke(Object func, Object* args, int argc) {
+            if (func.type != AS_FUNC) {
+                cout<<"Couldn't find function named: "<<toString(func)<<endl;
+                return makeNil();
+            }
+            int base = tasks.size();
+            push(func);
+            for (int i = 0; i < argc; i++)
+                push(args[i]);
+            enterFunction(argc);
+            run(base);
+            return pop();
         }
         Context& context() {
             return cxt;
         }
 };
 
-#endif
\ No newline at end of file
+#endif